@@ -0,0 +1,89 @@
+// Key hashing microbenchmark: "k123456"-style keys, as sent by loadgen.
+//
+//   make bench && ./build/hash_bench
+//
+// Compares the old shard pick (std::hash + modulo by the shard count)
+// with kv_hash + top-bit shift, then what hashing a key once through a
+// CacheKey saves a GET: the handler uses the key four times (cache,
+// absent cache, write stripe, fill). A miss-then-fill is not timed: at
+// close to a microsecond it hides the few ns either way in its noise.
+
+#include "cache.h"
+#include "hash.h"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+static constexpr size_t NUM_KEYS = 1 << 20;
+static constexpr size_t NUM_SHARDS = 32;
+static constexpr int ROUNDS = 8;
+
+using Clock = std::chrono::steady_clock;
+
+template <typename Fn>
+static double ns_per_key(const std::vector<std::string> &keys, Fn &&fn) {
+    auto t0 = Clock::now();
+    for (int r = 0; r < ROUNDS; r++)
+        for (const std::string &k : keys)
+            fn(k);
+    auto t1 = Clock::now();
+    return std::chrono::duration<double, std::nano>(t1 - t0).count()
+         / ((double)keys.size() * ROUNDS);
+}
+
+// Largest shard load over the mean; 1.0 is a perfect spread.
+template <typename Pick>
+static double skew(const std::vector<std::string> &keys, Pick &&pick) {
+    std::vector<size_t> load(NUM_SHARDS);
+    for (const std::string &k : keys)
+        load[pick(k)]++;
+    size_t mx = 0;
+    for (size_t n : load) if (n > mx) mx = n;
+    return (double)mx * NUM_SHARDS / keys.size();
+}
+
+int main() {
+    std::mt19937 rng(42);
+    std::vector<std::string> keys;
+    keys.reserve(NUM_KEYS);
+    for (size_t i = 0; i < NUM_KEYS; i++)
+        keys.push_back("k" + std::to_string(rng() % 1000000));
+
+    volatile size_t sink = 0;
+
+    auto old_pick = [](std::string_view k) {
+        return std::hash<std::string_view>{}(k) % NUM_SHARDS;
+    };
+    auto new_pick = [](std::string_view k) {
+        return (size_t)(kv_hash(k) >> 59);          // 64 - log2(32)
+    };
+
+    double t_old = ns_per_key(keys, [&](const std::string &k) { sink += old_pick(k); });
+    double t_new = ns_per_key(keys, [&](const std::string &k) { sink += new_pick(k); });
+
+    std::printf("shard pick     std::hash %% n : %6.2f ns/key  skew %.3f\n",
+                t_old, skew(keys, old_pick));
+    std::printf("shard pick     kv_hash >> s  : %6.2f ns/key  skew %.3f\n",
+                t_new, skew(keys, new_pick));
+
+    // the key uses of a GET that misses, hashed each time or once
+    double t_each = ns_per_key(keys, [&](const std::string &k) {
+        for (int i = 0; i < 4; i++)
+            sink += CacheKey(k).hash;
+    });
+    double t_one = ns_per_key(keys, [&](const std::string &k) {
+        CacheKey ck(k);
+        for (int i = 0; i < 4; i++)
+            sink += ck.hash;
+    });
+
+    std::printf("GET key hashes hash per use  : %6.2f ns/key\n", t_each);
+    std::printf("GET key hashes CacheKey once : %6.2f ns/key\n", t_one);
+
+    (void)sink;
+    return 0;
+}
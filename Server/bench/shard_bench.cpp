@@ -0,0 +1,121 @@
+// Shard contention microbenchmark.
+//
+//   make bench && ./build/shard_bench [threads]
+//
+// Each thread runs a 90/10 get/put mix for a fixed time, first on keys of
+// a shard of its own, then on keys spread over all shards. With a shard
+// per thread nothing is logically shared, so any slowdown as threads are
+// added comes from cache lines the shards (or their neighbours) share;
+// run it under `perf c2c record` to see which. The spread case adds the
+// real contention on shard locks and sequence counters.
+//
+// To compare shard layouts, build this same file in a worktree of the
+// older commit and run both binaries on the same host.
+
+#include "cache.h"
+#include "hash.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr size_t NUM_SHARDS = 32;
+static constexpr unsigned SHARD_BITS = 5;           // log2(NUM_SHARDS)
+static constexpr size_t KEYS_PER_THREAD = 4096;
+static constexpr int PUT_PERCENT = 10;
+static constexpr auto RUN_TIME = std::chrono::seconds(2);
+
+// Keys whose hash lands in shard s.
+static std::vector<std::string> keys_in_shard(size_t s, size_t n) {
+    std::vector<std::string> keys;
+    for (size_t i = 0; keys.size() < n; i++) {
+        std::string k = "k" + std::to_string(i);
+        if ((kv_hash(k) >> (64 - SHARD_BITS)) == s)
+            keys.push_back(std::move(k));
+    }
+    return keys;
+}
+
+static std::vector<std::string> keys_anywhere(size_t seed, size_t n) {
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < n; i++)
+        keys.push_back("k" + std::to_string(seed * n + i));
+    return keys;
+}
+
+// Operations per second over all threads.
+static double run(ShardedLRUCache &cache, const std::vector<std::vector<std::string>> &keys) {
+    std::atomic<bool> go{false}, stop{false};
+    std::atomic<uint64_t> total{0};
+    std::string value(64, 'v');
+
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < keys.size(); t++) {
+        pool.emplace_back([&, t] {
+            std::mt19937 rng((unsigned)t);
+            std::vector<CacheKey> cks(keys[t].begin(), keys[t].end());
+            for (const CacheKey &k : cks)
+                cache.cache_put(k, value);
+
+            std::string out;
+            uint64_t ops = 0;
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < 64; i++) {
+                    const CacheKey &k = cks[rng() % cks.size()];
+                    if ((int)(rng() % 100) < PUT_PERCENT)
+                        cache.cache_put(k, value);
+                    else
+                        cache.cache_get(k, out);
+                }
+                ops += 64;
+            }
+            total.fetch_add(ops);
+        });
+    }
+
+    go.store(true, std::memory_order_release);
+    auto t0 = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(RUN_TIME);
+    stop.store(true);
+    for (std::thread &t : pool)
+        t.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    return total.load() / secs;
+}
+
+int main(int argc, char **argv) {
+    size_t threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10)
+                              : std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    if (threads > NUM_SHARDS) threads = NUM_SHARDS;
+
+    CacheOptions o;
+    o.num_shards = NUM_SHARDS;
+    o.byte_budget = 256u << 20;
+    o.policy = EvictionPolicy::LRU;
+
+    std::vector<std::vector<std::string>> own, spread;
+    for (size_t t = 0; t < threads; t++) {
+        own.push_back(keys_in_shard(t, KEYS_PER_THREAD));
+        spread.push_back(keys_anywhere(t, KEYS_PER_THREAD));
+    }
+
+    for (size_t n = 1; n <= threads; n *= 2) {
+        std::vector<std::vector<std::string>> a(own.begin(), own.begin() + n);
+        std::vector<std::vector<std::string>> b(spread.begin(), spread.begin() + n);
+
+        ShardedLRUCache c1(o), c2(o);
+        double own_ops = run(c1, a);
+        double spread_ops = run(c2, b);
+        std::printf("%2zu threads  shard each: %7.2f Mops/s  spread: %7.2f Mops/s\n",
+                    n, own_ops / 1e6, spread_ops / 1e6);
+    }
+    return 0;
+}
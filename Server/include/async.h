@@ -2,12 +2,55 @@
 #define KV_ASYNC_H
 
 #include <string>
-#include <queue>
+#include <vector>
+#include <deque>
+#include <unordered_map>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <functional>
 #include "dbpool.h"
+#include "ring.h"
+
+// Write-behind to MySQL.
+//  - the key space is split by hash among the writer threads, each with
+//    its own queue, pending map and pool connection while it writes, so
+//    producers of different keys do not meet and a key's writes stay
+//    in order on the one thread that owns it.
+//  - producers hand writes over through a bounded lock-free ring
+//    (ring.h), moving the key and value in; they take no lock unless
+//    the writer asked to be woken for their write, and sleep until the
+//    writer drains it when the ring is full.
+//  - the writer moves them on into a map keyed by key that holds only
+//    the latest operation on each (a delete is kept as a tombstone), so
+//    a key written many times before it is flushed costs one row. Keys
+//    leave in the order they became pending; a write to a key whose
+//    batch is already being written starts a new pending entry.
+//  - a writer takes keys in batches: once one is pending it waits up
+//    to batch_window for more, or until max_batch are pending.
+//  - a batch is written in one transaction, as one multi-row INSERT ...
+//    ON DUPLICATE KEY UPDATE (split when it gets long) and one DELETE
+//    ... WHERE k IN (...).
+//  - if the transaction fails it is rolled back and the batch replayed
+//    one statement per task, so one bad row only loses itself.
+//  - what is queued is bounded, in writes and in bytes, per writer.
+//    A write that does not fit is handled by the when_full policy:
+//    BLOCK waits for room, SHED refuses it (the caller reports an
+//    error), SYNC queues it anyway and waits until it is committed, so
+//    the caller pays for MySQL directly while keeping per-key order.
+//    Memory then grows only by the writes callers are waiting on. Rings
+//    are sized to hold the bound; one found full anyway (no bound on
+//    writes) is waited on under BLOCK, refuses the write under SHED, and
+//    under SYNC is skipped: the write goes to MySQL directly once all
+//    before it are in.
+//  - on_commit, if set, is called once for every write taken, with its
+//    hash, when the write is in MySQL (or failed there and was logged)
+//    or was replaced by a later write to its key. Until then a SELECT
+//    may still return what the write replaces.
+//  - stop() writes out whatever is still pending.
 
 // Types of async operations
 enum class AsyncOpType {
@@ -18,31 +61,124 @@ enum class AsyncOpType {
 struct AsyncTask {
     AsyncOpType type;
     std::string key;
+    uint64_t hash;       // kv_hash(key); picks the writer
     std::string value;   // used only for insert
+    std::chrono::steady_clock::time_point queued{};
+};
+
+// What a write that finds the queue full does.
+enum class Backpressure {
+    BLOCK,
+    SHED,
+    SYNC
+};
+
+struct AsyncOptions {
+    size_t max_batch = 512;                        // keys per transaction
+    std::chrono::milliseconds batch_window{5};     // wait for a batch to fill
+    size_t writers = 1;                            // threads, each a connection
+    size_t queue_slots = 4096;                     // ring size per writer, or its max_queued share
+    size_t max_queued = 0;                         // writes; 0: unbounded
+    size_t max_queued_bytes = 0;                   // keys, values, overhead; 0: unbounded
+    Backpressure when_full = Backpressure::BLOCK;
+    std::function<void(uint64_t hash)> on_commit;  // on a writer thread; keep it short
+};
+
+struct AsyncStats {
+    uint64_t queued = 0;           // writes accepted, not yet in MySQL
+    uint64_t queued_bytes = 0;
+    uint64_t oldest_ms = 0;        // age of the oldest of them
+    uint64_t coalesced = 0;        // writes absorbed by a later one to the key
+    uint64_t blocked = 0;          // writes that waited for room
+    uint64_t shed = 0;             // writes refused
+    uint64_t synced = 0;           // writes that waited to be committed
 };
 
 class AsyncWriter {
 public:
-    AsyncWriter(MySQLPool *pool);
+    AsyncWriter(MySQLPool *pool, const AsyncOptions &opts = AsyncOptions());
     ~AsyncWriter();
 
-    void async_insert(const std::string &key, const std::string &value);
-    void async_delete(const std::string &key);
+    // hash is kv_hash(key), which the caller has already computed for
+    // the cache (CacheKey::hash). False if the write was shed: it will
+    // not reach MySQL.
+    bool async_insert(std::string key, uint64_t hash, std::string value);
+    bool async_delete(std::string key, uint64_t hash);
 
-    void start();   // start worker thread
-    void stop();    // stop worker thread safely
+    void start();   // start worker threads
+    void stop();    // stop worker threads safely
+
+    // Summed over the writers. Takes no locks.
+    AsyncStats stats() const;
 
 private:
-    void worker_loop();  // worker thread function
+    // ticket is that of the write that created the entry, queued its time.
+    struct PendingWrite {
+        AsyncOpType type;
+        uint64_t hash;
+        std::string value;
+        uint64_t ticket;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    static constexpr uint64_t NO_WAKE = UINT64_MAX;
+
+    // One writer's share of the keys. Producers touch the ring, wake_at
+    // and the queue charges (and the locks when they have to wake the
+    // writer or wait on it); the pending map and order are the writer's.
+    struct alignas(64) Partition {
+        MpscRing<AsyncTask> ring;
+        // ticket of the write the sleeping writer wants to be woken for
+        alignas(64) std::atomic<uint64_t> wake_at{NO_WAKE};
+        std::mutex mu;
+        std::condition_variable cv;
+
+        // charged by producers, released by the writer
+        alignas(64) std::atomic<size_t> entries{0};
+        std::atomic<size_t> bytes{0};
+        std::atomic<int> waiters{0};        // producers in room_cv
+        std::atomic<uint64_t> committed{0}; // every ticket below is in MySQL
+        std::mutex room_mu;
+        std::condition_variable room_cv;
+
+        alignas(64) std::unordered_map<std::string, PendingWrite> pending;
+        std::deque<const std::string *> order;    // keys of pending, oldest first
+        std::atomic<int64_t> oldest{0};     // steady-clock ns of order's front; 0: none
+        std::atomic<uint64_t> coalesced{0};
+        std::atomic<uint64_t> blocked{0};
+        std::atomic<uint64_t> shed{0};
+        std::atomic<uint64_t> synced{0};
+        std::thread worker;
+
+        explicit Partition(size_t slots) : ring(slots) {}
+    };
 
-    std::queue<AsyncTask> queue_;
-    std::mutex mu_;
-    std::condition_variable cv_;
+    static size_t charge(const std::string &key, const std::string &value);
+    Partition &partition_of(uint64_t hash);
+    bool enqueue(AsyncTask &&task);
+    bool reserve(Partition &p, size_t bytes, bool force);
+    void release(Partition &p, size_t entries, size_t bytes);
+    void wake_producers(Partition &p);
+    bool wait_for_slot(Partition &p, AsyncTask &task, uint64_t *ticket);
+    void wait_for_room(Partition &p, size_t bytes);
+    void wait_committed(Partition &p, uint64_t ticket);
+    void write_direct(Partition &p, const AsyncTask &task);
+    void take(Partition &p);
+    void note_oldest(Partition &p);
+    void wait_for(Partition &p, uint64_t ticket,
+                  std::chrono::steady_clock::time_point deadline);
+    void worker_loop(Partition &p);  // worker thread function
+    void write_batch(const std::vector<AsyncTask> &batch);
+    bool write_transaction(MYSQL *conn, const std::vector<AsyncTask> &batch);
+    void write_one(MYSQL *conn, const AsyncTask &task);
 
-    std::thread worker_;
+    std::vector<std::unique_ptr<Partition>> parts_;
     std::atomic<bool> running_;
 
     MySQLPool *dbpool_;
+    AsyncOptions opts_;
+    size_t entry_cap_;             // per writer
+    size_t byte_cap_;
 };
 
 #endif // KV_ASYNC_H
@@ -2,11 +2,18 @@
 #define KV_CACHE_H
 
 #include <string>
+#include <string_view>
 #include <vector>
-#include <unordered_map>
-#include <list>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
 #include <memory>
+#include <chrono>
+#include <cstdint>
+#include "slab.h"
+#include "hash.h"
 
 // Simple sharded LRU cache with user-friendly API:
 //   cache_get(key, val)
@@ -14,41 +21,633 @@
 //   cache_delete(key)
 //   cache_display()
 //   cache_size()
+//
+// Each shard owns an array of entries, grown in fixed-size segments that
+// are never freed or moved, so an entry index stays valid for the life of
+// the cache. An entry points at an immutable blob holding the key and the
+// value, carries intrusive LRU links, and is found through an
+// open-addressing table of (hash tag, entry index) slots that doubles
+// when it gets half full.
+//
+// Capacity is either an entry count per shard or, with byte_budget set,
+// a total number of bytes. Every entry is charged its key and value plus
+// the blob, entry and table overhead, and puts evict until the shard is
+// back under its share of the budget.
+//
+// Blobs are carved from a per-shard slab allocator (slab.h), so puts do
+// not go through malloc and freed memory is reused by size class instead
+// of fragmenting the process heap. Charges use the slab chunk size.
+//
+// Lookups take no lock. Readers probe the table inside an EpochGuard and
+// match the key against the blob; writers hold the shard mutex, replace
+// blobs instead of editing them, and retire the old ones until no reader
+// can still see them. A per-shard sequence counter lets a reader that
+// found nothing tell a real miss from a probe that raced a mutation.
+//
+// Entries may carry a TTL. The expiry time lives in the blob, so a get
+// that finds an expired entry reports a miss without taking the lock.
+// Each shard also files its TTL entries in a hierarchical timing wheel;
+// puts and an optional background sweep advance the wheel and drop
+// everything that came due in bulk, so expired memory is given back
+// even for keys nobody asks for again.
+//
+// The contents can be written to a snapshot file and loaded back, e.g.
+// across a restart. Each shard's entries are stored coldest first, so
+// reloading them in order restores the recency order; loading runs one
+// thread per group of shards.
+//
+// Hot keys can be replicated (hot_replicas > 1). A key whose sketch
+// count saturates is entered in a small directory, and each reading
+// thread then serves it from its own lane: a read-only copy kept as an
+// ordinary entry in another shard, named by the key's directory
+// version. A write to the key moves the version on, which makes the old
+// copies unreachable, and deletes them. Readers of one popular key then
+// spread their counters and LRU relinks over several shards.
+//
+// An optional per-thread L1 tier (l1_entries > 0) sits in front of all
+// of this: a small direct-mapped table of copied values owned by each
+// reading thread. An L1 copy records the write generation of its key's
+// stripe when it was taken; cache_put and cache_delete bump the stripe,
+// which voids every thread's copy at once. An L1 hit reads no shared
+// state beyond that generation, and every so many hits a copy is
+// revalidated against the shared cache to keep its recency up to date.
+//
+// Values of compress_min bytes or more are stored gzip-compressed
+// (codec.h) when that makes them smaller, and charged at their compressed
+// size. Gets decompress them outside any lock; a handle-based get may
+// instead take the compressed bytes as they are, for a client that
+// accepts gzip. The L1 tier only holds plain values.
+//
+// With a spill file configured, entries evicted for room are written to
+// a log-structured file on local disk (spill.h) instead of being lost,
+// and a get that misses in memory looks there before reporting a miss.
+// A hit is put back in memory, unless a write to the key got in first.
+//
+// Keys are hashed once, with kv_hash (hash.h), into a CacheKey that the
+// caller can reuse across calls for the same request. The shard count is
+// a power of two: the top hash bits pick the shard, the low bits the
+// table slot, and the tag compares the middle bits.
+//
+// The shard count and the capacity can be changed while the cache is in
+// use (cache_resize). The shards live in a map that is replaced as a
+// whole: the new map takes all reads and writes at once, while a
+// background thread drains the old one into it a small batch at a time,
+// coldest entries first, holding one old shard lock per batch. Until the
+// old map is empty a lookup checks it before the new one, and a write
+// fills the new map before it drops the old copy, under the old shard's
+// lock, so an entry in transit is never missed and never overwrites a
+// newer value. Operations run inside an epoch (or, without a free epoch
+// slot, a shared lock on the map), which tells the resize when none can
+// still be using the old map alone: only then do writes move to the new
+// map and the drain begin, and only once the old map is unpublished and
+// waited out again is it freed.
+//
+// With numa set, on a machine where the process may run on more than
+// one NUMA node, the shards are split into runs of consecutive indexes,
+// one per node (topology.h), and everything a shard allocates - the
+// shard itself, its entries, table, sketch and slab pages - is bound to
+// that node. Routing stays hash-based, so a thread reaches shards on
+// every node; each shard counts the operations of threads on another
+// node, and the stats report the remote share.
+//
+// With admission enabled (W-TinyLFU) new keys first enter a small window
+// LRU. When the window overflows in a full shard its oldest entry has to
+// beat the main region's victim on estimated access frequency to get in,
+// so a scan of one-off keys cannot flush the hot set.
+
+// How a full shard picks its victim.
+//   LRU   - exact recency; a hit relinks the entry under the shard lock
+//           (skipped when the lock is busy, so readers never wait).
+//   CLOCK - a hit only sets the entry's reference bit; cache_put sweeps a
+//           clock hand over the entry array, clearing bits until it finds
+//           an unreferenced victim.
+enum class EvictionPolicy {
+    LRU,
+    CLOCK
+};
+
+struct CacheOptions {
+    size_t num_shards = 32;        // rounded up to a power of two
+    size_t per_shard_capacity = 256;
+    size_t byte_budget = 0;        // total bytes; replaces per_shard_capacity
+    EvictionPolicy policy = EvictionPolicy::LRU;
+    bool admission = false;        // W-TinyLFU filter in front of eviction
+    std::chrono::milliseconds default_ttl{0};     // 0: entries never expire
+    std::chrono::milliseconds expiry_interval{0}; // background sweep; 0: none
+    size_t hot_replicas = 0;       // shards serving each hot key; < 2: off
+    size_t l1_entries = 0;         // per-thread L1 slots (power of two); 0: off
+    size_t compress_min = 0;       // gzip values of at least this size; 0: off
+    std::string spill_path;        // file for the disk tier
+    size_t spill_bytes = 0;        // size of the disk tier; 0: off
+    bool numa = false;             // place shards on NUMA nodes (if several)
+};
+
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t inserts = 0;          // new entries
+    uint64_t updates = 0;          // values replaced in place
+    uint64_t evictions = 0;        // entries dropped to make room
+    uint64_t lock_waits = 0;       // shard lock attempts that found it held
+    uint64_t admitted = 0;         // window entries that won a main slot
+    uint64_t rejected = 0;         // window entries dropped by the filter
+    uint64_t expired = 0;          // entries dropped by their TTL
+    uint64_t replica_hits = 0;     // hits served by a hot-key copy
+    uint64_t l1_hits = 0;          // hits served by a thread's L1 (approximate)
+    uint64_t spilled = 0;          // evicted entries written to the disk tier
+    uint64_t spill_hits = 0;       // misses served from it (also counted as misses)
+    uint64_t entries = 0;
+    uint64_t bytes = 0;            // charged bytes currently cached
+    uint64_t mem_reserved = 0;     // slab pages and large blobs held
+    uint64_t mem_used = 0;         // slab chunk bytes in use
+    uint64_t mem_requested = 0;    // blob bytes actually needed
+    uint64_t accesses = 0;         // shard operations, counted when NUMA-placed
+    uint64_t remote = 0;           // of those, by threads on another node
+
+    // Share of reserved blob memory not holding blob data.
+    double fragmentation() const {
+        return mem_reserved ? 1.0 - (double)mem_requested / mem_reserved : 0.0;
+    }
+
+    double hit_ratio() const {
+        uint64_t total = hits + misses;
+        return total ? (double)hits / total : 0.0;
+    }
+
+    double remote_ratio() const {
+        return accesses ? (double)remote / accesses : 0.0;
+    }
+};
+
+// Counters of one shard, read without taking its lock.
+struct ShardStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t inserts = 0;
+    uint64_t updates = 0;
+    uint64_t evictions = 0;
+    uint64_t expired = 0;
+    uint64_t lock_waits = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+    int node = -1;                 // NUMA node, -1 when not placed
+    uint64_t accesses = 0;
+    uint64_t remote = 0;
+};
+
+class FrequencySketch;
+class SpillCache;
+struct CacheL1Slot;
+
+// A key and its hash. Converts implicitly from strings, so plain keys
+// still work; build one explicitly to look up and then fill the same key
+// without hashing it twice. Only views the key: the bytes must outlive it.
+struct CacheKey {
+    std::string_view str;
+    uint64_t hash;
+
+    CacheKey(std::string_view s) : str(s), hash(kv_hash(s)) {}
+    CacheKey(std::string_view s, uint64_t h) : str(s), hash(h) {}
+    CacheKey(const std::string &s) : CacheKey(std::string_view(s)) {}
+    CacheKey(const char *s) : CacheKey(std::string_view(s)) {}
+};
+
+// A pinned cache value. While the handle lives the bytes it points at
+// stay valid, even if the key is updated, deleted or evicted, so a
+// handler can write them to the socket without copying. Keep handles
+// short-lived: pinned memory is not reused until they are released.
+// A compressed value is decompressed into the handle, unless the get
+// asked for gzip, in which case gzipped() says the bytes are still gzip.
+class CacheHandle {
+public:
+    CacheHandle() = default;
+    ~CacheHandle() { reset(); }
+
+    CacheHandle(CacheHandle &&o) noexcept { *this = std::move(o); }
+    CacheHandle &operator=(CacheHandle &&o) noexcept;
+    CacheHandle(const CacheHandle &) = delete;
+    CacheHandle &operator=(const CacheHandle &) = delete;
+
+    explicit operator bool() const { return pins_ != nullptr; }
+    std::string_view value() const { return value_; }
+    bool gzipped() const { return gzipped_; }
+
+    void reset();
+
+private:
+    friend class ShardedLRUCache;
+
+    std::atomic<uint32_t> *pins_ = nullptr;
+    std::string_view value_;
+    std::string decoded_;          // value_ when it had to be decompressed
+    bool gzipped_ = false;
+};
 
 class ShardedLRUCache {
 public:
-    ShardedLRUCache(size_t num_shards = 32, size_t per_shard_capacity = 256);
+    ShardedLRUCache(size_t num_shards = 32, size_t per_shard_capacity = 256,
+                    EvictionPolicy policy = EvictionPolicy::LRU);
+    explicit ShardedLRUCache(const CacheOptions &opts);
+    ~ShardedLRUCache();
 
     // Returns true if key found, fills value.
-    bool cache_get(const std::string &key, std::string &value);
+    bool cache_get(const CacheKey &key, std::string &value);
+
+    // Zero-copy variant: on a hit, pins the value in cache memory. With
+    // accept_gzip a compressed value is handed out compressed.
+    bool cache_get(const CacheKey &key, CacheHandle &handle,
+                   bool accept_gzip = false);
+
+    // Insert/update key-value. The first form applies the default TTL;
+    // the second sets one for this entry (0 = never expires).
+    void cache_put(const CacheKey &key, std::string_view value);
+    void cache_put(const CacheKey &key, std::string_view value,
+                   std::chrono::milliseconds ttl);
 
-    // Insert/update key-value.
-    void cache_put(const std::string &key, const std::string &value);
+    // Store a value just read from the backing store, unless gen has
+    // moved from seen. The check is made under the shard lock, so a writer
+    // that moves gen before it puts or deletes the key always wins.
+    void cache_fill(const CacheKey &key, std::string_view value,
+                    const std::atomic<uint64_t> &gen, uint64_t seen);
 
     // Remove a key.
-    void cache_delete(const std::string &key);
+    void cache_delete(const CacheKey &key);
 
     // Print all keys stored (for debugging).
     void cache_display();
 
-    // Approximate total size across all shards.
+    // Approximate total size across all shards. Takes no locks.
     size_t cache_size();
 
+    // Write all live entries to path (via a temporary file and rename).
+    // Safe to call while the cache is in use; each shard is locked only
+    // while its entries are copied out.
+    bool cache_dump(const std::string &path);
+
+    // Insert the entries of a snapshot written by cache_dump, using up
+    // to threads loaders. Entries whose TTL ran out since the dump are
+    // skipped, as are the coldest ones if a shard would overflow.
+    // Returns false if there is no readable snapshot at path.
+    bool cache_load(const std::string &path, size_t threads = 4);
+
+    // Drop every entry whose TTL has run out; returns how many went.
+    // The background sweep calls this every expiry_interval.
+    size_t cache_expire();
+
+    // Hit/miss and admission counters summed over all shards. Each shard
+    // is locked briefly for its memory figures.
+    CacheStats cache_stats();
+
+    // Per-shard counters, for spotting hot or contended shards. Takes no
+    // locks, so the figures of one shard need not be mutually consistent.
+    std::vector<ShardStats> cache_shard_stats() const;
+
+    // Re-partition into num_shards shards (rounded up to a power of two)
+    // sharing byte_budget bytes; 0 keeps the current value. Without a byte
+    // budget the total entry capacity is kept. Returns at once, with the
+    // entries moved over in the background, or false if an earlier resize
+    // is still running.
+    bool cache_resize(size_t num_shards, size_t byte_budget = 0);
+    bool cache_resizing() const { return resizing_.load(std::memory_order_acquire); }
+
+    // Whether the disk tier is in use: spill_bytes was set and the file
+    // at spill_path could be created and mapped.
+    bool cache_spilling() const { return spill_ != nullptr; }
+
 private:
-    struct Shard {
-        std::list<std::string> lru_list; // recent at front
-        std::unordered_map<std::string, std::pair<std::string, std::list<std::string>::iterator>> map;
-        std::mutex mtx;
-        size_t capacity;
+    static constexpr uint32_t NIL = UINT32_MAX;
+    static constexpr uint16_t NO_TIMER = UINT16_MAX;
+    static constexpr size_t HOT_SLOTS = 256;
+    static constexpr size_t READ_STRIPES = 8;
+
+    // Key and value of one entry in a single slab chunk. Never modified
+    // after it is published; an update installs a new blob. pins counts
+    // live CacheHandles; a retired blob is not freed while it is pinned.
+    // vlen is the stored size; a gzipped value is shorter than raw_len.
+    struct Blob {
+        uint64_t hash;
+        uint64_t expires;          // steady-clock ms, 0 if no TTL
+        uint32_t klen;
+        uint32_t vlen;
+        uint32_t raw_len;          // value size before compression
+        std::atomic<uint32_t> pins{0};
+
+        const char *key() const { return reinterpret_cast<const char *>(this + 1); }
+        const char *val() const { return key() + klen; }
+        size_t bytes() const { return sizeof(Blob) + klen + vlen; }
+        bool compressed() const { return vlen != raw_len; }
+        bool matches(std::string_view k, uint64_t h) const;
+    };
+
+    // Index slot, packed into one word so readers load it atomically:
+    // upper 32 bits hash tag, lower 32 bits entry index (NIL if empty).
+    using Slot = std::atomic<uint64_t>;
+
+    // Open-addressing table; slots follow the header in one allocation.
+    // Replaced as a whole when it grows.
+    struct Table {
+        size_t mask;
+
+        Slot *slots() { return reinterpret_cast<Slot *>(this + 1); }
+
+        static Table *create(size_t size, int node);
+        static void destroy(Table *t, int node);
+    };
 
-        Shard(size_t cap) : capacity(cap) {}
+    // Blob or table unlinked at epoch, freed once no reader can see it.
+    struct Retired {
+        Blob *blob;
+        Table *table;
+        uint64_t epoch;
     };
 
-    size_t shard_index(const std::string &key) const;
+    // One cache slot. prev/next link the entry into its region's LRU
+    // list while it is in use and chain the free list (next only) when it
+    // is not; in CLOCK mode the main list is kept in insertion order.
+    // Only blob and ref are read without the shard lock.
+    struct Entry {
+        std::atomic<Blob *> blob{nullptr};
+        uint64_t hash = 0;
+        uint32_t prev = NIL;
+        uint32_t next = NIL;
+        std::atomic<uint8_t> ref{0};
+        bool window = false;       // in the admission window, not main
+        uint16_t timer = NO_TIMER; // wheel bucket while the entry has a TTL
+        uint32_t tprev = NIL;      // bucket links
+        uint32_t tnext = NIL;
+    };
+
+    struct LruList {
+        uint32_t head = NIL;       // most recently used
+        uint32_t tail = NIL;       // least recently used
+        size_t size = 0;
+    };
+
+    // Hierarchical timing wheel: LEVELS rings of SLOTS buckets, each ring
+    // SLOTS times coarser than the one below. An entry sits in the finest
+    // ring that covers its expiry and moves down as the wheel turns.
+    struct TimerWheel {
+        static constexpr unsigned BITS = 6;
+        static constexpr unsigned SLOTS = 1u << BITS;
+        static constexpr unsigned LEVELS = 4;
+
+        uint32_t buckets[LEVELS * SLOTS];
+        uint64_t tick = 0;                  // next tick to process
+        size_t count = 0;                   // entries in the wheel
+    };
+
+    // Hot-key directory slot. word packs the key's upper hash bits with
+    // its current version (0 = empty), so readers see both in one load;
+    // hash is the full hash, only used to judge whether it is still hot.
+    struct HotSlot {
+        std::atomic<uint64_t> word{0};
+        std::atomic<uint64_t> hash{0};
+    };
+
+    // Blob evicted under a shard lock, pinned until the thread writes it
+    // to the spill tier; version is its stripe's spill version then.
+    struct SpillVictim {
+        Blob *blob;
+        uint64_t version;
+    };
+
+    // Counters bumped by lock-free readers. Each shard has READ_STRIPES
+    // of them, one cache line each, picked by thread, so readers hitting
+    // the same shard do not all write the same line.
+    struct alignas(64) ReadCounters {
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> replica_hits{0};
+        std::atomic<uint64_t> accesses{0};  // only when the shard has a node
+        std::atomic<uint64_t> remote{0};
+    };
+
+    // Laid out by who writes what, each group on cache lines of its own,
+    // so a writer holding the lock does not keep invalidating the lines
+    // lock-free readers load on every probe. Shards sit next to each
+    // other in one array (ShardMap), so the alignment also keeps
+    // neighbouring shards apart.
+    struct alignas(64) Shard {
+        // Read-mostly: set up with the shard, or replaced only when the
+        // table grows.
+        std::atomic<Entry *> *segs;         // entry segments
+        std::atomic<Table *> table;         // power-of-two, linear probing
+        std::unique_ptr<FrequencySketch> sketch;
+        SpillCache *spill = nullptr;        // where evictions go, if anywhere
+        size_t window_cap = 0;              // 0 when admission is off
+        size_t capacity;                    // max entries
+        size_t byte_cap;                    // max charged bytes
+        int node;                           // NUMA node of its memory, or -1
+
+        // Read on every probe, written twice per table change.
+        alignas(64) std::atomic<uint32_t> seq{0};  // odd while the table changes
+
+        // The lock, and what only its holder touches. lock_waits is
+        // bumped by those who find the lock held, whose attempt has
+        // pulled in this line already.
+        alignas(64) std::mutex mtx;
+        std::atomic<uint64_t> lock_waits{0};
+        uint32_t next_unused = 0;           // entries ever handed out
+        uint32_t free_head = NIL;
+        uint32_t hand = 0;                  // CLOCK sweep position
+        LruList lru;                        // main region
+        LruList window;                     // admission window
+        // written under the lock; atomic so stats can read them without it
+        std::atomic<size_t> count{0};
+        std::atomic<size_t> bytes{0};       // charged bytes in use
+        std::vector<Retired> retired;
+        SlabAllocator slab;
+        TimerWheel wheel;
+
+        ReadCounters reads[READ_STRIPES];
+        // the rest are bumped by the lock holder
+        alignas(64) std::atomic<uint64_t> inserts{0};
+        std::atomic<uint64_t> updates{0};
+        std::atomic<uint64_t> evictions{0};
+        std::atomic<uint64_t> admitted{0};
+        std::atomic<uint64_t> rejected{0};
+        std::atomic<uint64_t> expired{0};
+
+        Shard(size_t cap, size_t bytes_max, bool admission, bool track_frequency,
+              size_t sketch_max, int node);
+        ~Shard();
+
+        // Take the shard lock, counting the times someone else held it.
+        std::unique_lock<std::mutex> lock();
+        ReadCounters &reader();
+        // Count an operation, and whether it came from another node.
+        void count_access();
+
+        Entry &entry(uint32_t i) const;
+        Blob *make_blob(std::string_view k, uint64_t h, std::string_view v,
+                        uint32_t raw_len, uint64_t expires);
+        void free_blob(Blob *b);
+        uint32_t alloc_entry();
+        void grow_table();
+
+        // Locked probe: table position of key, or the empty slot where
+        // it would go.
+        size_t probe(std::string_view key, uint64_t h) const;
+        // Table position that points at entry i (which must be in use).
+        size_t slot_of(uint32_t i) const;
+        // Unlocked probe: entry index holding key and its blob, or NIL.
+        // Sets *stable when a miss was observed without a racing writer.
+        uint32_t probe_unlocked(std::string_view key, uint64_t h,
+                                Blob **out, bool *stable) const;
+        void erase_slot(size_t pos);
+
+        void write_begin();
+        void write_end();
+
+        LruList &list_of(uint32_t i) { return entry(i).window ? window : lru; }
+        void lru_unlink(uint32_t i);
+        void lru_push_front(LruList &l, uint32_t i);
+        void lru_touch(uint32_t i);
+        void release(uint32_t i);
+        void evict(uint32_t i);
+        void drop(uint32_t i);
+        // Drop key if it is here. Caller holds the lock.
+        void remove(std::string_view key, uint64_t h);
+        // Drop the entry with full hash h, whatever its key. Caller holds
+        // the lock.
+        void remove_hash(uint64_t h);
+        uint32_t pick_victim(EvictionPolicy policy);
+        void make_room(EvictionPolicy policy);
+
+        void timer_add(uint32_t i, uint64_t tick);
+        void timer_remove(uint32_t i);
+        // Turn the wheel up to now_ms and evict what came due. Caller
+        // holds the lock but must not be inside write_begin/write_end.
+        size_t expire(uint64_t now_ms);
+
+        void retire(Blob *b, Table *t = nullptr);
+        void reclaim();
+    };
+
+    // The shards and how hashes map onto them. Replaced, not changed, by
+    // a resize; the top shift bits of a hash pick the shard. The shards
+    // sit in cache-line aligned arrays, one per part: a single part
+    // unless they are NUMA-placed, in which case part p holds a run of
+    // consecutive indexes and lives on node nodes[p].
+    struct ShardMap {
+        static constexpr size_t MAX_PARTS = 8;
+
+        size_t num_shards;
+        unsigned shift;            // 64 - log2(num_shards)
+        unsigned part_shift;       // log2(shards per part)
+        size_t num_parts;
+        Shard *parts[MAX_PARTS];
+        int nodes[MAX_PARTS];      // -1 when not placed
+        // as the old map: set once no operation can still be using this
+        // map alone; until then writes go here rather than to the new one
+        std::atomic<bool> draining{false};
+
+        // Parts for as many of nodes as fit, or one if there are none.
+        ShardMap(size_t n, const std::vector<int> &nodes);
+        ~ShardMap();
+        ShardMap(const ShardMap &) = delete;
+        ShardMap &operator=(const ShardMap &) = delete;
+
+        // A shift by 64 is undefined, hence the single-shard case.
+        size_t index(uint64_t h) const { return shift < 64 ? (size_t)(h >> shift) : 0; }
+        Shard *at(size_t i) const {
+            return &parts[i >> part_shift][i & (((size_t)1 << part_shift) - 1)];
+        }
+        int node_of(size_t i) const { return nodes[i >> part_shift]; }
+        Shard *shard(uint64_t h) const { return at(index(h)); }
+    };
+
+    // The maps an operation has to cover: the current one and, while a
+    // resize drains it, the previous one (nullptr otherwise).
+    struct MapView {
+        ShardMap *old;
+        ShardMap *cur;
+        bool draining;             // old->draining, loaded after both
+    };
+
+    // Held by every public operation that reaches the shards.
+    struct MapGuard;
+
+    static size_t entry_charge(size_t klen, size_t vlen);
+    static size_t shard_count(size_t n);
+    ShardMap *build_map(size_t num_shards, size_t per_shard_capacity,
+                        size_t byte_budget) const;
+    MapView maps() const;
+    template <typename Fn>
+    bool lookup(const CacheKey &key, Fn &&on_hit);
+    template <typename Fn>
+    bool lookup_shard(const CacheKey &key, Fn &&on_hit);
+    template <typename Fn>
+    bool lookup_in(Shard *sh, const CacheKey &key, Fn &&on_hit, bool count_miss);
+    template <typename Fn>
+    bool lookup_replica(uint64_t home_hash, const CacheKey &rk, Fn &&on_hit);
+    uint64_t replica_hash(uint64_t h, uint32_t version, uint32_t lane) const;
+    void maybe_promote(uint64_t h);
+    void invalidate_hot(const CacheKey &key);
+    void erase_copies(uint64_t h, uint32_t version);
+    void erase(const CacheKey &key);
+    void erase_in(Shard *sh, const CacheKey &key);
+
+    CacheL1Slot *l1_slot(uint64_t h);
+    std::atomic<uint64_t> &l1_gen(uint64_t h);
+    bool l1_valid(CacheL1Slot &s, const CacheKey &key, uint64_t gen);
+    void l1_fill(CacheL1Slot &s, const CacheKey &key, uint64_t gen,
+                 std::string_view value, uint64_t expires);
+    void l1_count_hit();
+    void l1_invalidate(const CacheKey &key);
+    void touch(Shard *sh, uint32_t i, Blob *seen);
+    std::string_view encode(std::string_view value) const;
+    void put(const CacheKey &key, std::string_view stored, uint32_t raw_len,
+             uint64_t ttl_ms, const uint64_t *spill_version = nullptr,
+             const std::atomic<uint64_t> *gen = nullptr, uint64_t gen_seen = 0);
+    void put_in(Shard *sh, const CacheKey &key, std::string_view stored, uint32_t raw_len,
+                uint64_t expires, const uint64_t *spill_version,
+                const std::atomic<uint64_t> *gen = nullptr, uint64_t gen_seen = 0);
+    static std::vector<SpillVictim> &spill_victims();
+    void spill_out();
+    bool unspill(const CacheKey &key);
+    void dump_shard(Shard *sh, std::string &out, uint64_t *records);
+    void load_section(const char *p, const char *end);
+    static void add_counters(CacheStats &st, const Shard *sh);
+    void expiry_loop();
+    void migrate(ShardMap *from, ShardMap *to);
+    void wait_for_operations();
+
+    size_t per_shard_capacity_;    // entry limit when there is no byte budget
+    size_t byte_budget_;
+    EvictionPolicy policy_;
+    bool admission_;
+    uint64_t default_ttl_ms_;
+    size_t compress_min_;
+    bool numa_;
+    std::atomic<ShardMap *> map_{nullptr};
+    std::atomic<ShardMap *> old_map_{nullptr};  // being drained by a resize
+    mutable std::shared_mutex map_mtx_;         // for operations without an epoch slot
+
+    uint32_t hot_lanes_;           // copies per hot key, home included
+    std::unique_ptr<HotSlot[]> hot_;
+    std::atomic<uint64_t> hot_versions_{0};
+
+    uint32_t id_;                  // index of this cache's per-thread L1
+    size_t l1_entries_ = 0;
+    std::unique_ptr<std::atomic<uint64_t>[]> l1_gens_;
+    std::atomic<uint64_t> l1_hits_{0};
+
+    std::unique_ptr<SpillCache> spill_;
+
+    std::chrono::milliseconds expiry_interval_;
+    std::thread expiry_thread_;
+    std::mutex expiry_mtx_;
+    std::condition_variable expiry_cv_;
+    bool stopping_ = false;
+
+    std::mutex dump_mtx_;          // one dump at a time
 
-    size_t num_shards_;
-    size_t per_shard_capacity_;
-    std::vector<std::unique_ptr<Shard>> shards_;
+    std::mutex resize_mtx_;        // one resize at a time
+    std::thread resize_thread_;
+    std::atomic<bool> resizing_{false};
+    std::atomic<bool> resize_stop_{false};
+    CacheStats drained_;           // counters of maps a resize has freed
 };
 
 #endif // KV_CACHE_H
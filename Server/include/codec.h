@@ -0,0 +1,20 @@
+#ifndef KV_CODEC_H
+#define KV_CODEC_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// gzip coding for cache values (zlib, fastest level). The gzip wrapper
+// rather than raw deflate lets stored bytes go out unchanged to clients
+// that send Accept-Encoding: gzip. Each thread keeps its own deflate and
+// inflate stream, reset between calls.
+
+// Compress in into out. Returns false (out unspecified) unless the result
+// is smaller than the input.
+bool gzip_encode(std::string_view in, std::string &out);
+
+// Decompress in, which must inflate to exactly raw_len bytes, into out.
+bool gzip_decode(std::string_view in, char *out, size_t raw_len);
+
+#endif // KV_CODEC_H
@@ -0,0 +1,68 @@
+#ifndef KV_EPOCH_H
+#define KV_EPOCH_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Epoch-based reclamation for lock-free readers.
+//  - readers wrap every access to shared nodes in an EpochGuard.
+//  - writers unlink a node, stamp it with retire_epoch() and keep it
+//    on a private list.
+//  - a node stamped e may be freed once reclaim_bound() > e, i.e. no
+//    reader that could still hold a pointer to it is active.
+//
+// Each reading thread owns one cache-line sized slot in a fixed table.
+// If every slot is taken the guard is inactive and the caller must use
+// its locked path instead.
+
+class EpochDomain {
+public:
+    static constexpr size_t MAX_READERS = 512;
+
+    static EpochDomain &instance();
+
+    // Announce the calling thread as reading. Nests. Returns false if no
+    // reader slot could be claimed.
+    bool enter();
+    void exit();
+
+    // Epoch to stamp a node with right after unlinking it.
+    uint64_t retire_epoch();
+
+    // Advances the global epoch and returns the oldest epoch still
+    // announced by an active reader (or the new global epoch if none).
+    uint64_t reclaim_bound();
+
+private:
+    static constexpr uint64_t IDLE = UINT64_MAX;
+
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> epoch{IDLE};
+        std::atomic<bool> taken{false};
+    };
+
+    friend struct EpochThread;
+
+    int claim_slot();
+    void release_slot(int slot);
+
+    std::atomic<uint64_t> global_{1};
+    ReaderSlot slots_[MAX_READERS];
+};
+
+class EpochGuard {
+public:
+    EpochGuard() : active_(EpochDomain::instance().enter()) {}
+    ~EpochGuard() { if (active_) EpochDomain::instance().exit(); }
+
+    EpochGuard(const EpochGuard &) = delete;
+    EpochGuard &operator=(const EpochGuard &) = delete;
+
+    bool active() const { return active_; }
+
+private:
+    bool active_;
+};
+
+#endif // KV_EPOCH_H
@@ -0,0 +1,87 @@
+#ifndef KV_HASH_H
+#define KV_HASH_H
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// 64-bit key hash used by the cache (wyhash, final version 4).
+// Every output bit depends on every input byte, so callers can slice
+// the result: the cache takes the top bits for the shard and the low
+// bits for the table slot. Keys of up to 16 bytes, such as the
+// "k123456" keys loadgen sends, take a single 128-bit multiply round.
+
+namespace kv_hash_detail {
+
+static constexpr uint64_t SECRET[4] = {
+    0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+    0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+};
+
+static inline void mum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t r8(const uint8_t *p) { uint64_t v; std::memcpy(&v, p, 8); return v; }
+static inline uint64_t r4(const uint8_t *p) { uint32_t v; std::memcpy(&v, p, 4); return v; }
+static inline uint64_t r3(const uint8_t *p, size_t k) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+} // namespace kv_hash_detail
+
+static inline uint64_t kv_hash(std::string_view key, uint64_t seed = 0) {
+    using namespace kv_hash_detail;
+
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(key.data());
+    size_t len = key.size();
+    uint64_t a, b;
+
+    seed ^= mix(seed ^ SECRET[0], SECRET[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (r4(p) << 32) | r4(p + ((len >> 3) << 2));
+            b = (r4(p + len - 4) << 32) | r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = r3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = mix(r8(p) ^ SECRET[1], r8(p + 8) ^ seed);
+                see1 = mix(r8(p + 16) ^ SECRET[2], r8(p + 24) ^ see1);
+                see2 = mix(r8(p + 32) ^ SECRET[3], r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mix(r8(p) ^ SECRET[1], r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = r8(p + i - 16);
+        b = r8(p + i - 8);
+    }
+
+    a ^= SECRET[1];
+    b ^= seed;
+    mum(&a, &b);
+    return mix(a ^ SECRET[0] ^ len, b ^ SECRET[1]);
+}
+
+#endif // KV_HASH_H
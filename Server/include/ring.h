@@ -0,0 +1,95 @@
+#ifndef KV_RING_H
+#define KV_RING_H
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+// Bounded lock-free queue for many producers and one consumer (after
+// Vyukov's bounded MPMC queue).
+//  - capacity is a power of two; each cell carries a sequence number
+//    saying whose turn it is: the producer holding ticket t may fill
+//    the cell when it reads t, the consumer may empty it at t + 1.
+//  - producers claim a ticket with one CAS on tail_, then move their
+//    item in and publish it. A full ring fails the push, leaving the
+//    item with the caller.
+//  - the consumer needs no atomic read-modify-write at all.
+//  - tickets increase by one per push, so they double as positions:
+//    published(t) tells the consumer whether item t has arrived.
+
+template <typename T>
+class MpscRing {
+public:
+    explicit MpscRing(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) n <<= 1;
+        mask_ = n - 1;
+        cells_.reset(new Cell[n]);
+        for (size_t i = 0; i < n; i++)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    MpscRing(const MpscRing &) = delete;
+    MpscRing &operator=(const MpscRing &) = delete;
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // Move item in and set *ticket, or return false if the ring is full.
+    bool push(T &&item, uint64_t *ticket) {
+        uint64_t t = tail_.load(std::memory_order_relaxed);
+        Cell *c;
+        for (;;) {
+            c = &cells_[t & mask_];
+            int64_t d = (int64_t)(c->seq.load(std::memory_order_acquire) - t);
+            if (d == 0) {
+                if (tail_.compare_exchange_weak(t, t + 1, std::memory_order_relaxed))
+                    break;
+            } else if (d < 0) {
+                return false;
+            } else {
+                t = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        c->item = std::move(item);
+        c->seq.store(t + 1, std::memory_order_release);
+        *ticket = t;
+        return true;
+    }
+
+    // Consumer only.
+    bool pop(T &out) {
+        Cell &c = cells_[head_ & mask_];
+        if (c.seq.load(std::memory_order_acquire) != head_ + 1)
+            return false;
+        out = std::move(c.item);
+        c.seq.store(head_ + mask_ + 1, std::memory_order_release);
+        head_++;
+        return true;
+    }
+
+    // Tickets handed out so far. Any thread.
+    uint64_t tail() const { return tail_.load(std::memory_order_acquire); }
+
+    // Consumer only: ticket of the next item to pop.
+    uint64_t head() const { return head_; }
+
+    // Item t has been pushed and not yet popped. Consumer only, for t at
+    // or past head().
+    bool published(uint64_t t) const {
+        return cells_[t & mask_].seq.load(std::memory_order_acquire) == t + 1;
+    }
+
+private:
+    struct Cell {
+        std::atomic<uint64_t> seq;
+        T item;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<uint64_t> tail_{0};   // next ticket, shared by producers
+    alignas(64) uint64_t head_ = 0;               // the consumer's
+};
+
+#endif // KV_RING_H
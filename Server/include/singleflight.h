@@ -0,0 +1,59 @@
+#ifndef KV_SINGLEFLIGHT_H
+#define KV_SINGLEFLIGHT_H
+
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include "cache.h"
+
+// Request coalescing for cache misses (single-flight).
+//  - the first caller to miss on a key runs the load.
+//  - callers that miss on the same key while it runs wait for it and
+//    share its result instead of issuing their own query.
+//  - the call is forgotten as soon as it finishes, so a later miss
+//    loads again; results are never cached here.
+//  - in-flight calls live in a table striped by key hash.
+
+// Outcome of one load, shared by every caller that waited for it.
+struct FlightResult {
+    bool ok = false;         // the load ran without error
+    bool found = false;      // the key exists
+    std::string value;
+    std::string error;       // set when !ok
+};
+
+class SingleFlight {
+public:
+    using Loader = std::function<FlightResult()>;
+
+    // Run load for key, or wait for the run already in flight for it.
+    std::shared_ptr<const FlightResult> run(const CacheKey &key, const Loader &load);
+
+    // Callers served by another caller's load.
+    uint64_t coalesced() const { return coalesced_.load(std::memory_order_relaxed); }
+
+private:
+    struct Call {
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool done = false;
+        FlightResult result;
+    };
+
+    struct Stripe {
+        std::mutex mtx;
+        std::unordered_map<std::string, std::shared_ptr<Call>> calls;
+    };
+
+    static constexpr size_t STRIPES = 64;
+
+    Stripe stripes_[STRIPES];
+    std::atomic<uint64_t> coalesced_{0};
+};
+
+#endif // KV_SINGLEFLIGHT_H
@@ -0,0 +1,45 @@
+#ifndef KV_SKETCH_H
+#define KV_SKETCH_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Count-min sketch of recent access frequency, used by the cache's
+// TinyLFU admission filter.
+//  - DEPTH rows of saturating 4-bit counters (stored one per byte).
+//  - frequency() is the minimum over the rows, so it never undercounts.
+//  - after sample_size increments every counter is halved, so old
+//    popularity fades and the estimate follows the current workload.
+//
+// increment() is called from lock-free cache readers. Counters are
+// relaxed atomics; a lost update under a race only makes the estimate
+// slightly low, which is harmless for an admission heuristic.
+
+class FrequencySketch {
+public:
+    // Counters go on NUMA node node, or anywhere when it is -1.
+    explicit FrequencySketch(size_t capacity, int node = -1);
+    ~FrequencySketch();
+
+    FrequencySketch(const FrequencySketch &) = delete;
+    FrequencySketch &operator=(const FrequencySketch &) = delete;
+
+    void increment(uint64_t h);
+    uint32_t frequency(uint64_t h) const;
+
+private:
+    static constexpr int DEPTH = 4;
+    static constexpr uint8_t MAX_COUNT = 15;
+
+    size_t index(uint64_t h, int row) const;
+    void age();
+
+    size_t width_;
+    size_t sample_size_;
+    int node_;
+    std::atomic<uint8_t> *counters_;    // DEPTH * width_
+    std::atomic<size_t> additions_{0};
+};
+
+#endif // KV_SKETCH_H
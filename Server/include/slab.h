@@ -0,0 +1,82 @@
+#ifndef KV_SLAB_H
+#define KV_SLAB_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Slab allocator for cache blobs, one per shard (memcached-style).
+//  - chunk sizes grow by ~1.25x from 32 bytes up to PAGE_SIZE / 4.
+//  - 32 KB pages are carved into chunks of a single size class.
+//  - a page whose chunks are all free goes back to a pool shared by all
+//    classes, so memory does not stay stuck in a class the workload has
+//    moved away from; the pool keeps a few pages and frees the rest.
+//  - requests above the largest class go to operator new.
+//  - given a NUMA node, all memory is bound to it: pages are carved from
+//    node-local extents, and a page the pool has no room for keeps its
+//    address but hands its memory back (MADV_DONTNEED) until reused.
+//  - not thread-safe: the owning shard's mutex protects it.
+
+struct SlabStats {
+    size_t reserved = 0;     // pages held (including pooled) + large allocs
+    size_t used = 0;         // chunk bytes handed out
+    size_t requested = 0;    // bytes callers asked for
+};
+
+class SlabAllocator {
+public:
+    static constexpr size_t PAGE_SIZE = 32 * 1024;
+
+    explicit SlabAllocator(int node = -1);
+    ~SlabAllocator();
+
+    SlabAllocator(const SlabAllocator &) = delete;
+    SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+    void *allocate(size_t n);
+    // n must be the size passed to allocate().
+    void deallocate(void *p, size_t n);
+
+    // Bytes an n-byte request really consumes.
+    static size_t chunk_size(size_t n);
+
+    SlabStats stats() const { return stats_; }
+
+private:
+    struct Page {
+        Page *prev;
+        Page *next;
+        void *free_list;     // freed chunks inside this page
+        uint32_t cls;
+        uint32_t used;       // chunks handed out
+        uint32_t carved;     // chunks ever carved (bump pointer)
+    };
+
+    struct PageList {
+        Page *head = nullptr;
+        void push(Page *p);
+        void remove(Page *p);
+    };
+
+    struct SizeClass {
+        PageList partial;    // pages with at least one free chunk
+        PageList full;
+    };
+
+    Page *take_page(uint32_t cls);
+    void give_page(Page *p);
+    Page *node_page();
+
+    int node_;               // -1: no placement
+
+    std::vector<SizeClass> classes_;
+    PageList pool_;
+    size_t pool_pages_ = 0;
+    std::vector<char *> extents_;       // node-local page extents
+    char *extent_next_ = nullptr;       // next page never handed out
+    size_t extent_left_ = 0;
+    std::vector<Page *> idle_;          // node pages with no memory behind them
+    SlabStats stats_;
+};
+
+#endif // KV_SLAB_H
@@ -0,0 +1,115 @@
+#ifndef KV_SPILL_H
+#define KV_SPILL_H
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+// Second-level cache for entries evicted from memory, kept in a file on
+// local disk (log-structured, memory-mapped).
+//  - the file is split into fixed-size segments used as a ring: records
+//    are appended at the head, and when the head moves on to the next
+//    segment everything still in it is dropped (FIFO).
+//  - an in-memory index maps each key hash to its latest record; the key
+//    itself is only in the file and is compared on every read.
+//  - readers copy a record out under their segment's shared lock; the
+//    writer takes it exclusively only to recycle the segment.
+//  - a version per stripe of keys guards against stale records: a write
+//    to the key brackets its change with begin_write/end_write, and put
+//    or a promotion back into memory only go ahead if the version is the
+//    one taken before, with no write in progress.
+//  - nothing survives a restart; the file is recreated on open.
+
+class SpillCache {
+public:
+    // Map a file of about bytes at path. Check ok() before use.
+    SpillCache(const std::string &path, size_t bytes);
+    ~SpillCache();
+
+    SpillCache(const SpillCache &) = delete;
+    SpillCache &operator=(const SpillCache &) = delete;
+
+    bool ok() const { return base_ != nullptr; }
+
+    // Append a record, unless version(hash) has moved on from version.
+    // expires is a steady-clock ms deadline, 0 if none.
+    void put(std::string_view key, uint64_t hash, std::string_view value,
+             uint32_t raw_len, uint64_t expires, uint64_t version);
+
+    // Copy out the latest unexpired record for key.
+    bool get(std::string_view key, uint64_t hash, uint64_t now_ms,
+             std::string &value, uint32_t *raw_len, uint64_t *expires);
+
+    // Bracket a write to key: both drop its record and move the version.
+    void begin_write(uint64_t hash);
+    void end_write(uint64_t hash);
+
+    uint64_t version(uint64_t hash) const;
+    // No write to the stripe was in progress when v was read.
+    static bool stable(uint64_t v) { return (v & WRITERS_MASK) == 0; }
+
+    uint64_t written() const { return written_.load(std::memory_order_relaxed); }
+    uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+
+private:
+    // The low bits of a stripe version count writes in progress, the
+    // rest move on at every begin_write and end_write.
+    static constexpr uint64_t WRITERS_MASK = 0xffff;
+    static constexpr uint64_t WRITER = 1;
+    static constexpr uint64_t BUMP = 1ull << 16;
+
+    // Record header; key and value follow, padded to 8 bytes.
+    struct Record {
+        uint64_t hash;
+        uint64_t expires;
+        uint32_t klen;
+        uint32_t vlen;
+        uint32_t raw_len;
+        uint32_t unused;
+    };
+
+    // used is the writer's, under write_mtx_; gen changes under the
+    // exclusive lock whenever the segment is recycled.
+    struct Segment {
+        std::shared_mutex mtx;
+        uint32_t used = 0;
+        uint16_t gen = 0;
+    };
+
+    struct Stripe {
+        std::mutex mtx;
+        std::unordered_map<uint64_t, uint64_t> index;  // hash -> packed location
+        std::atomic<uint64_t> version{0};
+    };
+
+    static constexpr size_t STRIPES = 64;
+
+    static uint64_t pack(uint32_t seg, uint16_t gen, uint32_t off) {
+        return ((uint64_t)seg << 48) | ((uint64_t)gen << 32) | off;
+    }
+
+    Stripe &stripe(uint64_t hash) { return stripes_[hash & (STRIPES - 1)]; }
+    const Stripe &stripe(uint64_t hash) const { return stripes_[hash & (STRIPES - 1)]; }
+    void recycle(uint32_t s);
+
+    char *base_ = nullptr;
+    size_t bytes_ = 0;
+    int fd_ = -1;
+    size_t seg_bytes_ = 0;
+    uint32_t num_segs_ = 0;
+    std::unique_ptr<Segment[]> segs_;
+
+    std::mutex write_mtx_;
+    uint32_t head_ = 0;            // segment being appended to
+
+    Stripe stripes_[STRIPES];
+    std::atomic<uint64_t> written_{0};
+    std::atomic<uint64_t> hits_{0};
+};
+
+#endif // KV_SPILL_H
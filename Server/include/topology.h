@@ -0,0 +1,31 @@
+#ifndef KV_TOPOLOGY_H
+#define KV_TOPOLOGY_H
+
+#include <cstddef>
+#include <vector>
+
+// NUMA placement helpers, on top of libnuma (when built with HAVE_NUMA;
+// without it there is a single node and nothing is placed).
+//  - the nodes are the ones the process may run on, so a server started
+//    under taskset on one node sees a single node and places nothing.
+//  - with no NUMA support, or a single node, kv_numa_nodes() is empty,
+//    kv_this_node() is -1 and node allocations are plain ones.
+//  - a thread's node is looked up once and cached; it is exact for
+//    threads pinned with kv_pin_to_node and a good guess for the rest.
+
+// Nodes the process may run on, or none when there is nothing to place.
+const std::vector<int> &kv_numa_nodes();
+
+// Node of the calling thread, or -1.
+int kv_this_node();
+
+// Restrict the calling thread to the CPUs of node. False if that failed.
+bool kv_pin_to_node(int node);
+
+// bytes of page-aligned memory bound to node, or cache-line aligned
+// memory from the heap when node is -1. Throws std::bad_alloc.
+void *kv_node_alloc(size_t bytes, int node);
+// bytes and node must be the ones passed to kv_node_alloc.
+void kv_node_free(void *p, size_t bytes, int node);
+
+#endif // KV_TOPOLOGY_H
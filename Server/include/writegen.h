@@ -0,0 +1,55 @@
+#ifndef KV_WRITEGEN_H
+#define KV_WRITEGEN_H
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+// Write generations, striped by key hash, that keep miss fills from
+// caching what a write has replaced.
+//  - each stripe holds a generation in the high 32 bits and, in the low
+//    32, the writes to its keys still in progress: a write counts in
+//    before it queues the row or touches a cache, and stays counted
+//    until it is in MySQL, not just until the handler returns. Until
+//    then a SELECT may still see the row it replaces.
+//  - a get reads the stripe before its lookups. On a miss it fills the
+//    caches only if no write was in progress then, through cache_fill,
+//    which checks under the shard lock that the stripe has not moved
+//    since. So neither a stale row nor a stale 404 is cached: a write
+//    the cache refused (admission, eviction) is still covered until
+//    MySQL has it.
+//  - stripes are many, so a steady trickle of queued writes leaves
+//    almost every key fillable.
+
+class WriteGenerations {
+public:
+    static constexpr size_t STRIPES = 1 << 16;
+    static constexpr uint64_t ACTIVE = 0xffffffffull;
+
+    WriteGenerations() : gen_(new std::atomic<uint64_t>[STRIPES]()) {}
+
+    WriteGenerations(const WriteGenerations &) = delete;
+    WriteGenerations &operator=(const WriteGenerations &) = delete;
+
+    std::atomic<uint64_t> &stripe(uint64_t hash) {
+        return gen_[hash & (STRIPES - 1)];
+    }
+
+    // Move the generation and count n writes in.
+    void begin(uint64_t hash, uint32_t n = 1) {
+        stripe(hash).fetch_add((1ull << 32) + n, std::memory_order_acq_rel);
+    }
+
+    void end(uint64_t hash, uint32_t n = 1) {
+        stripe(hash).fetch_sub(n, std::memory_order_acq_rel);
+    }
+
+    // Whether a miss that read gen before its lookups may fill.
+    static bool fillable(uint64_t gen) { return (gen & ACTIVE) == 0; }
+
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> gen_;
+};
+
+#endif // KV_WRITEGEN_H
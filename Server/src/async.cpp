@@ -1,9 +1,41 @@
 #include "async.h"
 #include <iostream>
 #include <sstream>
+#include <functional>
+#include <algorithm>
 
-AsyncWriter::AsyncWriter(MySQLPool *pool)
-    : dbpool_(pool), running_(false) {}
+// Statements of a batch are cut at about this many bytes, well under
+// the server's max_allowed_packet.
+static constexpr size_t MAX_STATEMENT_BYTES = 1 << 20;
+
+// Rough cost of a queued write besides its key and value: ring cell or
+// map node, order slot and string headers.
+static constexpr size_t QUEUED_OVERHEAD = 128;
+
+static std::string escape(MYSQL *conn, const std::string &s) {
+    std::string out;
+    out.resize(s.size() * 2 + 1);
+    unsigned long n = mysql_real_escape_string(conn, &out[0], s.c_str(), s.size());
+    out.resize(n);
+    return out;
+}
+
+AsyncWriter::AsyncWriter(MySQLPool *pool, const AsyncOptions &opts)
+    : running_(false), dbpool_(pool), opts_(opts)
+{
+    if (opts_.max_batch == 0)
+        opts_.max_batch = 1;
+    if (opts_.writers == 0)
+        opts_.writers = 1;
+    // each writer gets an even share, rounded up so no bound becomes 0
+    entry_cap_ = (opts_.max_queued + opts_.writers - 1) / opts_.writers;
+    byte_cap_ = (opts_.max_queued_bytes + opts_.writers - 1) / opts_.writers;
+    // room in the ring for all a writer may have queued, so the bounds,
+    // not the ring, decide when a write does not fit
+    size_t slots = std::max(opts_.queue_slots, entry_cap_);
+    for (size_t i = 0; i < opts_.writers; i++)
+        parts_.push_back(std::make_unique<Partition>(slots));
+}
 
 AsyncWriter::~AsyncWriter() {
     stop();
@@ -11,84 +43,379 @@ AsyncWriter::~AsyncWriter() {
 
 void AsyncWriter::start() {
     running_ = true;
-    worker_ = std::thread(&AsyncWriter::worker_loop, this);
+    for (size_t i = 0; i < opts_.writers; i++)
+        parts_[i]->worker = std::thread(&AsyncWriter::worker_loop, this, std::ref(*parts_[i]));
 }
 
 void AsyncWriter::stop() {
     if (!running_) return;
     running_ = false;
-    cv_.notify_all();
-    if (worker_.joinable())
-        worker_.join();
+    for (size_t i = 0; i < opts_.writers; i++) {
+        Partition &p = *parts_[i];
+        // under the lock, so a writer cannot miss it between check and wait
+        { std::lock_guard<std::mutex> lk(p.mu); }
+        p.cv.notify_all();
+        { std::lock_guard<std::mutex> lk(p.room_mu); }
+        p.room_cv.notify_all();
+    }
+    for (size_t i = 0; i < opts_.writers; i++) {
+        if (parts_[i]->worker.joinable())
+            parts_[i]->worker.join();
+    }
 }
 
-void AsyncWriter::async_insert(const std::string &key, const std::string &value) {
-    {
-        std::lock_guard<std::mutex> lk(mu_);
-        queue_.push({AsyncOpType::INSERT_OP, key, value});
+AsyncStats AsyncWriter::stats() const {
+    AsyncStats s;
+    int64_t oldest = 0;
+    for (size_t i = 0; i < opts_.writers; i++) {
+        const Partition &p = *parts_[i];
+        s.queued += p.entries.load(std::memory_order_relaxed);
+        s.queued_bytes += p.bytes.load(std::memory_order_relaxed);
+        s.coalesced += p.coalesced.load(std::memory_order_relaxed);
+        s.blocked += p.blocked.load(std::memory_order_relaxed);
+        s.shed += p.shed.load(std::memory_order_relaxed);
+        s.synced += p.synced.load(std::memory_order_relaxed);
+        int64_t t = p.oldest.load(std::memory_order_relaxed);
+        if (t != 0 && (oldest == 0 || t < oldest))
+            oldest = t;
     }
-    cv_.notify_one();
+    if (oldest != 0) {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        int64_t age = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() - oldest;
+        s.oldest_ms = age > 0 ? age / 1000000 : 0;
+    }
+    return s;
 }
 
-void AsyncWriter::async_delete(const std::string &key) {
-    {
-        std::lock_guard<std::mutex> lk(mu_);
-        queue_.push({AsyncOpType::DELETE_OP, key, ""});
+size_t AsyncWriter::charge(const std::string &key, const std::string &value) {
+    return key.size() + value.size() + QUEUED_OVERHEAD;
+}
+
+AsyncWriter::Partition &AsyncWriter::partition_of(uint64_t hash) {
+    return *parts_[hash % opts_.writers];
+}
+
+bool AsyncWriter::async_insert(std::string key, uint64_t hash, std::string value) {
+    return enqueue({AsyncOpType::INSERT_OP, std::move(key), hash, std::move(value),
+                    std::chrono::steady_clock::now()});
+}
+
+bool AsyncWriter::async_delete(std::string key, uint64_t hash) {
+    return enqueue({AsyncOpType::DELETE_OP, std::move(key), hash, std::string(),
+                    std::chrono::steady_clock::now()});
+}
+
+// The fences pair with the one in wait_for: either the writer sees the
+// write in the ring, or the producer sees the writer waiting for it.
+bool AsyncWriter::enqueue(AsyncTask &&task) {
+    Partition &p = partition_of(task.hash);
+    size_t bytes = charge(task.key, task.value);
+    bool sync = false, blocked = false;
+
+    if (!reserve(p, bytes, false)) {
+        release(p, 0, 0);
+        switch (opts_.when_full) {
+        case Backpressure::SHED:
+            p.shed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        case Backpressure::BLOCK:
+            p.blocked.fetch_add(1, std::memory_order_relaxed);
+            blocked = true;
+            wait_for_room(p, bytes);
+            break;
+        case Backpressure::SYNC:
+            reserve(p, bytes, true);
+            sync = true;
+            break;
+        }
     }
-    cv_.notify_one();
+
+    // The ring holds every write the bounds admit, so it is only full
+    // past them (SYNC) or with no bound on entries. Only BLOCK waits for
+    // a slot: SHED must never hold up the caller.
+    uint64_t ticket;
+    if (!p.ring.push(std::move(task), &ticket)) {
+        if (opts_.when_full == Backpressure::SHED) {
+            release(p, 1, bytes);
+            p.shed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (opts_.when_full == Backpressure::SYNC) {
+            p.synced.fetch_add(1, std::memory_order_relaxed);
+            write_direct(p, task);
+            release(p, 1, bytes);
+            if (opts_.on_commit)
+                opts_.on_commit(task.hash);
+            return true;
+        }
+        if (!blocked)
+            p.blocked.fetch_add(1, std::memory_order_relaxed);
+        if (!wait_for_slot(p, task, &ticket)) {
+            release(p, 1, bytes);
+            p.shed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (p.wake_at.load(std::memory_order_relaxed) == ticket) {
+        std::lock_guard<std::mutex> lk(p.mu);
+        p.cv.notify_one();
+    }
+
+    if (sync) {
+        p.synced.fetch_add(1, std::memory_order_relaxed);
+        wait_committed(p, ticket);
+    }
+    return true;
+}
+
+// Charge a write to p, unless that takes it over a bound. A write into
+// an empty queue always fits, so one larger than the byte bound is not
+// refused forever.
+bool AsyncWriter::reserve(Partition &p, size_t bytes, bool force) {
+    size_t n = p.entries.fetch_add(1) + 1;
+    size_t b = p.bytes.fetch_add(bytes) + bytes;
+    if (force || n == 1 ||
+        ((entry_cap_ == 0 || n <= entry_cap_) && (byte_cap_ == 0 || b <= byte_cap_)))
+        return true;
+    // taken back without a wakeup; enqueue gives one, as it may have
+    // kept out a waiter that nothing else is left to wake
+    p.entries.fetch_sub(1);
+    p.bytes.fetch_sub(bytes);
+    return false;
 }
 
+void AsyncWriter::release(Partition &p, size_t entries, size_t bytes) {
+    p.entries.fetch_sub(entries);
+    p.bytes.fetch_sub(bytes);
+    wake_producers(p);
+}
 
-void AsyncWriter::worker_loop() {
-    while (running_) {
-        AsyncTask task;
+// Pairs with wait_for_slot, wait_for_room and wait_committed, which count
+// themselves in waiters before they look: either they see the room, or
+// this sees them.
+void AsyncWriter::wake_producers(Partition &p) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (p.waiters.load() > 0) {
+        { std::lock_guard<std::mutex> lk(p.room_mu); }
+        p.room_cv.notify_all();
+    }
+}
 
-        // Wait for work
-        {
-            std::unique_lock<std::mutex> lk(mu_);
-            cv_.wait(lk, [&]{ return !queue_.empty() || !running_; });
+// Sleep until task fits in the full ring, which take() empties. False if
+// stop() came first: nothing will drain the ring any more.
+bool AsyncWriter::wait_for_slot(Partition &p, AsyncTask &task, uint64_t *ticket) {
+    std::unique_lock<std::mutex> lk(p.room_mu);
+    bool ok = false;
+    p.waiters.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    p.room_cv.wait(lk, [&]{ return (ok = p.ring.push(std::move(task), ticket)) || !running_; });
+    p.waiters.fetch_sub(1);
+    return ok;
+}
 
-            if (!running_) break;
-            task = queue_.front();
-            queue_.pop();
+// Once stop() has begun the write is taken over the bound: the writers
+// are draining and will not be back for it.
+void AsyncWriter::wait_for_room(Partition &p, size_t bytes) {
+    std::unique_lock<std::mutex> lk(p.room_mu);
+    bool ok = false;
+    p.waiters.fetch_add(1);
+    p.room_cv.wait(lk, [&]{ return (ok = reserve(p, bytes, false)) || !running_; });
+    p.waiters.fetch_sub(1);
+    if (!ok)
+        reserve(p, bytes, true);
+}
+
+// Write task on a connection of its own, once every write handed to the
+// ring before it is in, so it cannot overtake an older write to its key.
+void AsyncWriter::write_direct(Partition &p, const AsyncTask &task) {
+    uint64_t t = p.ring.tail();
+    if (t > 0)
+        wait_committed(p, t - 1);
+
+    MYSQL *conn = dbpool_->acquire();
+    write_one(conn, task);
+    dbpool_->release(conn);
+}
+
+void AsyncWriter::wait_committed(Partition &p, uint64_t ticket) {
+    std::unique_lock<std::mutex> lk(p.room_mu);
+    p.waiters.fetch_add(1);
+    p.room_cv.wait(lk, [&]{ return p.committed.load() > ticket || !running_; });
+    p.waiters.fetch_sub(1);
+}
+
+// Move what is in the ring into the pending map. Map nodes do not move,
+// so order can point at their keys. A write replaced by a later one is
+// no longer queued, and done as far as on_commit is concerned; the entry
+// keeps the ticket and time of its first. Producers waiting for a slot are woken once some are free.
+void AsyncWriter::take(Partition &p) {
+    AsyncTask task;
+    size_t gone = 0, gone_bytes = 0;
+    uint64_t head = p.ring.head();
+    for (size_t n = p.ring.capacity(); n > 0; n--) {
+        uint64_t ticket = p.ring.head();
+        if (!p.ring.pop(task))
+            break;
+        auto r = p.pending.try_emplace(std::move(task.key));
+        PendingWrite &w = r.first->second;
+        if (r.second) {
+            p.order.push_back(&r.first->first);
+            w.hash = task.hash;
+            w.ticket = ticket;
+            w.queued = task.queued;
+        } else {
+            p.coalesced.fetch_add(1, std::memory_order_relaxed);
+            gone++;
+            gone_bytes += charge(r.first->first, w.value);
+            if (opts_.on_commit)
+                opts_.on_commit(w.hash);
         }
+        w.type = task.type;
+        w.value = std::move(task.value);
+    }
+    if (gone > 0)
+        release(p, gone, gone_bytes);
+    else if (p.ring.head() != head)
+        wake_producers(p);
+}
 
-        // Process task
-        MYSQL *conn = dbpool_->acquire();
+static int64_t steady_ns(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+void AsyncWriter::note_oldest(Partition &p) {
+    p.oldest.store(p.order.empty() ? 0 : steady_ns(p.pending.at(*p.order.front()).queued),
+                   std::memory_order_relaxed);
+}
+
+// Sleep until write ticket is in the ring, stop() or deadline (none if
+// it is time_point::max()).
+void AsyncWriter::wait_for(Partition &p, uint64_t ticket,
+                           std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lk(p.mu);
+    p.wake_at.store(ticket, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto ready = [&]{ return p.ring.published(ticket) || !running_; };
+    if (deadline == std::chrono::steady_clock::time_point::max())
+        p.cv.wait(lk, ready);
+    else
+        p.cv.wait_until(lk, deadline, ready);
+    p.wake_at.store(NO_WAKE, std::memory_order_relaxed);
+}
 
-        if (task.type == AsyncOpType::INSERT_OP) {
-            std::string esk, esv;
-            esk.resize(task.key.size()*2 + 1);
-            esv.resize(task.value.size()*2 + 1);
 
-            unsigned long klen = mysql_real_escape_string(conn, &esk[0], task.key.c_str(), task.key.size());
-            unsigned long vlen = mysql_real_escape_string(conn, &esv[0], task.value.c_str(), task.value.size());
+void AsyncWriter::worker_loop(Partition &p) {
+    using clock = std::chrono::steady_clock;
+    std::vector<AsyncTask> batch;
 
-            esk.resize(klen);
-            esv.resize(vlen);
+    for (;;) {
+        take(p);
+        note_oldest(p);
+        if (p.order.empty()) {
+            if (!running_) break;
+            // wait for work
+            wait_for(p, p.ring.head(), clock::time_point::max());
+            continue;
+        }
 
-            std::stringstream q;
-            q << "INSERT INTO kvstore (k,hash,v) VALUES ('"
-              << esk << "', 0, '" << esv << "') "
-              << "ON DUPLICATE KEY UPDATE v=VALUES(v), updated=CURRENT_TIMESTAMP";
+        // give the batch a moment to fill, unless it is full already
+        size_t want = opts_.max_batch - std::min(opts_.max_batch, p.order.size());
+        if (want > 0 && running_) {
+            want = std::min(want, p.ring.capacity());
+            wait_for(p, p.ring.head() + want - 1, clock::now() + opts_.batch_window);
+            take(p);
+        }
 
-            if (mysql_query(conn, q.str().c_str())) {
-                std::cerr << "[AsyncWriter] Insert error: " << mysql_error(conn) << "\n";
-            }
+        size_t bytes = 0;
+        while (!p.order.empty() && batch.size() < opts_.max_batch) {
+            auto node = p.pending.extract(*p.order.front());
+            p.order.pop_front();
+            PendingWrite &w = node.mapped();
+            bytes += charge(node.key(), w.value);
+            batch.push_back({w.type, std::move(node.key()), w.hash, std::move(w.value), w.queued});
         }
-        else if (task.type == AsyncOpType::DELETE_OP) {
-            std::string esk;
-            esk.resize(task.key.size()*2 + 1);
+        // the batch is older than anything left; it stays the oldest
+        // until it is in
+        p.oldest.store(steady_ns(batch.front().queued), std::memory_order_relaxed);
 
-            unsigned long klen = mysql_real_escape_string(conn, &esk[0], task.key.c_str(), task.key.size());
-            esk.resize(klen);
+        write_batch(batch);
+        if (opts_.on_commit)
+            for (const AsyncTask &t : batch)
+                opts_.on_commit(t.hash);
 
-            std::string q = "DELETE FROM kvstore WHERE k='" + esk + "'";
-            if (mysql_query(conn, q.c_str())) {
-                std::cerr << "[AsyncWriter] Delete error: " << mysql_error(conn) << "\n";
-            }
+        // every write before the first still pending is in now
+        uint64_t done = p.order.empty() ? p.ring.head() : p.pending.at(*p.order.front()).ticket;
+        p.committed.store(done);
+        release(p, batch.size(), bytes);
+        batch.clear();
+    }
+}
+
+void AsyncWriter::write_batch(const std::vector<AsyncTask> &batch) {
+    MYSQL *conn = dbpool_->acquire();
+
+    if (!write_transaction(conn, batch)) {
+        std::cerr << "[AsyncWriter] Batch of " << batch.size() << " failed ("
+                  << mysql_error(conn) << "), writing one by one\n";
+        mysql_query(conn, "ROLLBACK");
+        for (const AsyncTask &t : batch)
+            write_one(conn, t);
+    }
+
+    dbpool_->release(conn);
+}
+
+// A batch holds distinct keys, so the inserts and the delete commute.
+bool AsyncWriter::write_transaction(MYSQL *conn, const std::vector<AsyncTask> &batch) {
+    if (mysql_query(conn, "START TRANSACTION"))
+        return false;
+
+    std::string ins, del;
+    auto send = [&](std::string &q, const char *tail) {
+        if (q.empty()) return true;
+        q += tail;
+        bool ok = mysql_real_query(conn, q.data(), q.size()) == 0;
+        q.clear();
+        return ok;
+    };
+    const char *ins_tail = " ON DUPLICATE KEY UPDATE v=VALUES(v), updated=CURRENT_TIMESTAMP";
+
+    for (const AsyncTask &t : batch) {
+        if (t.type == AsyncOpType::INSERT_OP) {
+            ins += ins.empty() ? "INSERT INTO kvstore (k,hash,v) VALUES " : ",";
+            ins += "('" + escape(conn, t.key) + "', 0, '" + escape(conn, t.value) + "')";
+            if (ins.size() >= MAX_STATEMENT_BYTES && !send(ins, ins_tail))
+                return false;
+        } else {
+            del += del.empty() ? "DELETE FROM kvstore WHERE k IN (" : ",";
+            del += "'" + escape(conn, t.key) + "'";
+            if (del.size() >= MAX_STATEMENT_BYTES && !send(del, ")"))
+                return false;
         }
+    }
+    if (!send(ins, ins_tail) || !send(del, ")"))
+        return false;
+
+    return mysql_query(conn, "COMMIT") == 0;
+}
 
-        dbpool_->release(conn);
+void AsyncWriter::write_one(MYSQL *conn, const AsyncTask &task) {
+    if (task.type == AsyncOpType::INSERT_OP) {
+        std::stringstream q;
+        q << "INSERT INTO kvstore (k,hash,v) VALUES ('"
+          << escape(conn, task.key) << "', 0, '" << escape(conn, task.value) << "') "
+          << "ON DUPLICATE KEY UPDATE v=VALUES(v), updated=CURRENT_TIMESTAMP";
+
+        if (mysql_query(conn, q.str().c_str())) {
+            std::cerr << "[AsyncWriter] Insert error: " << mysql_error(conn) << "\n";
+        }
+    }
+    else if (task.type == AsyncOpType::DELETE_OP) {
+        std::string q = "DELETE FROM kvstore WHERE k='" + escape(conn, task.key) + "'";
+        if (mysql_query(conn, q.c_str())) {
+            std::cerr << "[AsyncWriter] Delete error: " << mysql_error(conn) << "\n";
+        }
     }
 }
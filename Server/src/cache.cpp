@@ -1,99 +1,1939 @@
 #include "cache.h"
+#include "epoch.h"
+#include "sketch.h"
+#include "codec.h"
+#include "spill.h"
+#include "topology.h"
 #include <iostream>
-#include <functional>
+#include <fstream>
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <new>
 
-ShardedLRUCache::ShardedLRUCache(size_t num_shards, size_t per_shard_capacity)
-    : num_shards_(num_shards), per_shard_capacity_(per_shard_capacity)
+CacheHandle &CacheHandle::operator=(CacheHandle &&o) noexcept {
+    if (this != &o) {
+        reset();
+        // a decompressed value lives in decoded_, which moves with it
+        bool own = o.value_.data() == o.decoded_.data();
+        pins_ = o.pins_;
+        decoded_ = std::move(o.decoded_);
+        value_ = own ? std::string_view(decoded_) : o.value_;
+        gzipped_ = o.gzipped_;
+        o.pins_ = nullptr;
+        o.value_ = {};
+        o.gzipped_ = false;
+    }
+    return *this;
+}
+
+void CacheHandle::reset() {
+    if (pins_)
+        pins_->fetch_sub(1, std::memory_order_acq_rel);
+    pins_ = nullptr;
+    value_ = {};
+    decoded_.clear();
+    gzipped_ = false;
+}
+
+// Retired blobs are reclaimed in batches of this size.
+static constexpr size_t RECLAIM_BATCH = 64;
+
+// Unlocked lookups that keep racing writers fall back to the lock.
+static constexpr int READ_RETRIES = 4;
+
+// Share of a shard given to the W-TinyLFU admission window.
+static constexpr size_t WINDOW_PERCENT = 1;
+
+// Entries are allocated in segments of 1 << SEG_SHIFT.
+static constexpr uint32_t SEG_SHIFT = 10;
+static constexpr uint32_t SEG_SIZE = 1u << SEG_SHIFT;
+
+static constexpr size_t INITIAL_TABLE_SIZE = 16;
+
+// Timing wheel resolution. An entry is due on the first tick at or after
+// its deadline, so the wheel never drops it early.
+static constexpr uint64_t TICK_MS = 16;
+
+// A key is hot once its sketch count saturates. Hits check for that on
+// every HOT_CHECK_INTERVAL-th call per thread, not every time.
+static constexpr uint32_t HOT_FREQUENCY = 15;
+static constexpr uint32_t HOT_CHECK_INTERVAL = 16;
+
+// Reading threads are dealt hot-key lanes round robin.
+static std::atomic<uint32_t> next_lane{0};
+static thread_local uint32_t tls_lane = next_lane.fetch_add(1, std::memory_order_relaxed);
+static thread_local uint32_t tls_hot_checks = 0;
+
+// L1 tier: values above L1_MAX_VALUE bytes are not copied; a copy is
+// revalidated against the shared cache after L1_MAX_USES hits; writes
+// bump one of L1_STRIPES generations; hits reach the stats in batches.
+static constexpr size_t L1_MAX_VALUE = 4096;
+static constexpr uint32_t L1_MAX_USES = 32;
+static constexpr size_t L1_STRIPES = 4096;
+static constexpr uint32_t L1_HIT_BATCH = 64;
+
+// A resize moves at most this many entries per old-shard lock hold, and
+// polls at this interval while it waits for operations or handles.
+static constexpr size_t MIGRATE_BATCH = 64;
+static constexpr std::chrono::milliseconds MIGRATE_POLL{1};
+
+// Entry size assumed when a byte budget has to be turned into an entry
+// count for sizing the sketch and the admission window.
+static constexpr size_t TYPICAL_ENTRY_BYTES = 256;
+
+// Keys the sketches of one map are sized for at most, split over its
+// shards: a sketch is allocated up front, so it must not follow a huge
+// budget (1 TB would mean 16 GB of counters). Past this many keys, about
+// 1 GB of typical entries, counters are shared by more keys and the
+// estimates get coarser; the sketches take 32 MB at most.
+static constexpr size_t SKETCH_MAX_KEYS = 1 << 22;
+
+// The top hash bits choose the shard, so the table position inside a
+// shard comes from the low bits and the tag from the middle ones; keys
+// of one shard share their top bits and would otherwise collide.
+static inline size_t home_slot(uint64_t h, size_t mask) {
+    return (size_t)h & mask;
+}
+
+static inline uint32_t hash_tag(uint64_t h) {
+    return (uint32_t)(h >> 24);
+}
+
+static inline uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline int64_t wall_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t deadline_tick(uint64_t expires) {
+    return (expires + TICK_MS - 1) / TICK_MS;
+}
+
+// One L1 slot. Only its owning thread touches it, except for handles,
+// which counts live CacheHandles on value; the slot is not refilled
+// while any remain.
+struct CacheL1Slot {
+    uint64_t hash = 0;
+    uint64_t gen = 0;              // stripe generation the copy belongs to
+    uint64_t expires = 0;
+    uint32_t uses = 0;
+    std::atomic<uint32_t> handles{0};
+    std::string key;
+    std::string value;
+};
+
+struct CacheL1 {
+    std::unique_ptr<CacheL1Slot[]> slots;
+    size_t mask;
+    uint32_t pending_hits = 0;
+
+    explicit CacheL1(size_t n) : slots(new CacheL1Slot[n]), mask(n - 1) {}
+};
+
+// Each thread's L1 tables, indexed by cache id. Ids are never reused, so
+// a table outliving its cache is only dead weight until the thread ends.
+static std::atomic<uint32_t> next_cache_id{0};
+static thread_local std::vector<std::unique_ptr<CacheL1>> tls_l1;
+
+static inline uint64_t hot_word(uint64_t h, uint32_t version) {
+    return (h & 0xffffffff00000000ULL) | version;
+}
+
+static inline bool hot_match(uint64_t w, uint64_t h) {
+    return w != 0 && (w >> 32) == (h >> 32);
+}
+
+static inline uint32_t hot_version(uint64_t w) { return (uint32_t)w; }
+
+static inline uint64_t slot_pack(uint32_t tag, uint32_t idx) {
+    return ((uint64_t)tag << 32) | idx;
+}
+
+static inline uint32_t slot_idx(uint64_t w) { return (uint32_t)w; }
+static inline uint32_t slot_tag(uint64_t w) { return (uint32_t)(w >> 32); }
+
+
+bool ShardedLRUCache::Blob::matches(std::string_view k, uint64_t h) const {
+    return hash == h && klen == k.size() && std::memcmp(key(), k.data(), klen) == 0;
+}
+
+ShardedLRUCache::Blob *ShardedLRUCache::Shard::make_blob(std::string_view k, uint64_t h,
+                                                         std::string_view v, uint32_t raw_len,
+                                                         uint64_t expires) {
+    void *mem = slab.allocate(sizeof(Blob) + k.size() + v.size());
+    Blob *b = new (mem) Blob;
+    b->hash = h;
+    b->expires = expires;
+    b->klen = (uint32_t)k.size();
+    b->vlen = (uint32_t)v.size();
+    b->raw_len = raw_len;
+    char *p = reinterpret_cast<char *>(b + 1);
+    std::memcpy(p, k.data(), k.size());
+    std::memcpy(p + k.size(), v.data(), v.size());
+    return b;
+}
+
+void ShardedLRUCache::Shard::free_blob(Blob *b) {
+    size_t n = b->bytes();
+    b->~Blob();
+    slab.deallocate(b, n);
+}
+
+// Bytes charged against the budget for one entry: the slab chunk that
+// holds the blob, the entry itself and its share of a half-full table.
+size_t ShardedLRUCache::entry_charge(size_t klen, size_t vlen) {
+    return SlabAllocator::chunk_size(sizeof(Blob) + klen + vlen)
+         + sizeof(Entry) + 2 * sizeof(Slot);
+}
+
+ShardedLRUCache::Table *ShardedLRUCache::Table::create(size_t size, int node) {
+    void *mem = kv_node_alloc(sizeof(Table) + size * sizeof(Slot), node);
+    Table *t = static_cast<Table *>(mem);
+    t->mask = size - 1;
+    Slot *s = t->slots();
+    for (size_t i = 0; i < size; i++)
+        new (&s[i]) Slot(slot_pack(0, NIL));
+    return t;
+}
+
+void ShardedLRUCache::Table::destroy(Table *t, int node) {
+    kv_node_free(t, sizeof(Table) + (t->mask + 1) * sizeof(Slot), node);
+}
+
+
+ShardedLRUCache::Shard::Shard(size_t cap, size_t bytes_max, bool admission,
+                              bool track_frequency, size_t sketch_max, int node)
+    : capacity(cap), byte_cap(bytes_max), node(node), slab(node)
 {
-    shards_.reserve(num_shards_);
-    for (size_t i = 0; i < num_shards; i++) {
-        shards_.push_back(std::make_unique<Shard>(per_shard_capacity));
+    size_t nsegs = (cap + SEG_SIZE - 1) / SEG_SIZE;
+    segs = static_cast<std::atomic<Entry *> *>(
+        kv_node_alloc(nsegs * sizeof(std::atomic<Entry *>), node));
+    for (size_t i = 0; i < nsegs; i++)
+        new (&segs[i]) std::atomic<Entry *>(nullptr);
+
+    table.store(Table::create(INITIAL_TABLE_SIZE, node), std::memory_order_relaxed);
+    retired.reserve(RECLAIM_BATCH * 2);
+
+    std::fill(std::begin(wheel.buckets), std::end(wheel.buckets), NIL);
+    wheel.tick = now_ms() / TICK_MS;
+
+    // a window needs at least one main slot left to compete for
+    size_t expected = std::min(cap, byte_cap / TYPICAL_ENTRY_BYTES);
+    if (admission && cap >= 2)
+        window_cap = std::max<size_t>(1, expected * WINDOW_PERCENT / 100);
+    if ((admission || track_frequency) && cap >= 2)
+        sketch = std::make_unique<FrequencySketch>(std::min(expected, sketch_max), node);
+}
+
+std::unique_lock<std::mutex> ShardedLRUCache::Shard::lock() {
+    std::unique_lock<std::mutex> lk(mtx, std::try_to_lock);
+    if (!lk.owns_lock()) {
+        lock_waits.fetch_add(1, std::memory_order_relaxed);
+        lk.lock();
+    }
+    return lk;
+}
+
+ShardedLRUCache::ReadCounters &ShardedLRUCache::Shard::reader() {
+    return reads[tls_lane & (READ_STRIPES - 1)];
+}
+
+void ShardedLRUCache::Shard::count_access() {
+    ReadCounters &rc = reader();
+    rc.accesses.fetch_add(1, std::memory_order_relaxed);
+    if (kv_this_node() != node)
+        rc.remote.fetch_add(1, std::memory_order_relaxed);
+}
+
+// No reader can be active once the cache itself is being destroyed.
+ShardedLRUCache::Shard::~Shard() {
+    for (uint32_t i = 0; i < next_unused; i++) {
+        Blob *b = entry(i).blob.load(std::memory_order_relaxed);
+        if (b) free_blob(b);
+    }
+    for (uint32_t s = 0; s * SEG_SIZE < next_unused; s++)
+        kv_node_free(segs[s].load(std::memory_order_relaxed), SEG_SIZE * sizeof(Entry), node);
+    kv_node_free(segs, (capacity + SEG_SIZE - 1) / SEG_SIZE * sizeof(std::atomic<Entry *>), node);
+
+    for (Retired &r : retired) {
+        if (r.blob) free_blob(r.blob);
+        if (r.table) Table::destroy(r.table, node);
+    }
+    Table::destroy(table.load(std::memory_order_relaxed), node);
+}
+
+// Readers reach i through a slot published after its segment, so the
+// acquire load always sees the segment.
+ShardedLRUCache::Entry &ShardedLRUCache::Shard::entry(uint32_t i) const {
+    return segs[i >> SEG_SHIFT].load(std::memory_order_acquire)[i & (SEG_SIZE - 1)];
+}
+
+// Caller guarantees count < capacity.
+uint32_t ShardedLRUCache::Shard::alloc_entry() {
+    if (free_head != NIL) {
+        uint32_t i = free_head;
+        free_head = entry(i).next;
+        return i;
+    }
+
+    uint32_t i = next_unused++;
+    if ((i & (SEG_SIZE - 1)) == 0) {
+        Entry *seg = static_cast<Entry *>(kv_node_alloc(SEG_SIZE * sizeof(Entry), node));
+        for (uint32_t e = 0; e < SEG_SIZE; e++)
+            new (&seg[e]) Entry;
+        segs[i >> SEG_SHIFT].store(seg, std::memory_order_release);
+    }
+    return i;
+}
+
+// Double the table. Readers still walking the old copy see a consistent
+// (if stale) index; their misses are retried because the caller bumped
+// seq, and the old copy is retired like a blob.
+void ShardedLRUCache::Shard::grow_table() {
+    Table *old = table.load(std::memory_order_relaxed);
+    Table *nt = Table::create((old->mask + 1) * 2, node);
+
+    for (size_t p = 0; p <= old->mask; p++) {
+        uint64_t w = old->slots()[p].load(std::memory_order_relaxed);
+        if (slot_idx(w) == NIL) continue;
+
+        size_t pos = home_slot(entry(slot_idx(w)).hash, nt->mask);
+        while (slot_idx(nt->slots()[pos].load(std::memory_order_relaxed)) != NIL)
+            pos = (pos + 1) & nt->mask;
+        nt->slots()[pos].store(w, std::memory_order_relaxed);
+    }
+
+    table.store(nt, std::memory_order_release);
+    retire(nullptr, old);
+}
+
+size_t ShardedLRUCache::Shard::probe(std::string_view key, uint64_t h) const {
+    Table *t = table.load(std::memory_order_relaxed);
+    uint32_t tag = hash_tag(h);
+    size_t pos = home_slot(h, t->mask);
+
+    for (;;) {
+        uint64_t w = t->slots()[pos].load(std::memory_order_relaxed);
+        if (slot_idx(w) == NIL)
+            return pos;
+        if (slot_tag(w) == tag &&
+            entry(slot_idx(w)).blob.load(std::memory_order_relaxed)->matches(key, h))
+            return pos;
+        pos = (pos + 1) & t->mask;
+    }
+}
+
+size_t ShardedLRUCache::Shard::slot_of(uint32_t i) const {
+    Table *t = table.load(std::memory_order_relaxed);
+    size_t pos = home_slot(entry(i).hash, t->mask);
+    while (slot_idx(t->slots()[pos].load(std::memory_order_relaxed)) != i)
+        pos = (pos + 1) & t->mask;
+    return pos;
+}
+
+uint32_t ShardedLRUCache::Shard::probe_unlocked(std::string_view key, uint64_t h,
+                                                Blob **out, bool *stable) const {
+    uint32_t s1 = seq.load(std::memory_order_acquire);
+    if (s1 & 1) {
+        *stable = false;
+        return NIL;
+    }
+
+    Table *t = table.load(std::memory_order_acquire);
+    uint32_t tag = hash_tag(h);
+    size_t pos = home_slot(h, t->mask);
+
+    // bounded: a concurrent shift could otherwise keep us walking
+    for (size_t n = 0; n <= t->mask; n++) {
+        uint64_t w = t->slots()[pos].load(std::memory_order_acquire);
+        uint32_t i = slot_idx(w);
+        if (i == NIL)
+            break;
+        if (slot_tag(w) == tag) {
+            Blob *b = entry(i).blob.load(std::memory_order_acquire);
+            if (b && b->matches(key, h)) {
+                *out = b;
+                return i;
+            }
+        }
+        pos = (pos + 1) & t->mask;
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    *stable = seq.load(std::memory_order_relaxed) == s1;
+    return NIL;
+}
+
+// Backward-shift deletion: pull later members of the probe run into the
+// hole so lookups never need tombstones.
+void ShardedLRUCache::Shard::erase_slot(size_t pos) {
+    Table *t = table.load(std::memory_order_relaxed);
+    Slot *slots = t->slots();
+    size_t mask = t->mask;
+    size_t hole = pos;
+    size_t cur = (pos + 1) & mask;
+
+    for (;;) {
+        uint64_t w = slots[cur].load(std::memory_order_relaxed);
+        if (slot_idx(w) == NIL)
+            break;
+        size_t want = home_slot(entry(slot_idx(w)).hash, mask);
+        // distance from home to cur vs home to hole (cyclic)
+        if (((cur - want) & mask) >= ((cur - hole) & mask)) {
+            slots[hole].store(w, std::memory_order_release);
+            hole = cur;
+        }
+        cur = (cur + 1) & mask;
+    }
+    slots[hole].store(slot_pack(0, NIL), std::memory_order_release);
+}
+
+void ShardedLRUCache::Shard::write_begin() {
+    seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void ShardedLRUCache::Shard::write_end() {
+    seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void ShardedLRUCache::Shard::lru_unlink(uint32_t i) {
+    Entry &e = entry(i);
+    LruList &l = list_of(i);
+    if (e.prev != NIL) entry(e.prev).next = e.next;
+    else l.head = e.next;
+    if (e.next != NIL) entry(e.next).prev = e.prev;
+    else l.tail = e.prev;
+    e.prev = e.next = NIL;
+    l.size--;
+}
+
+void ShardedLRUCache::Shard::lru_push_front(LruList &l, uint32_t i) {
+    Entry &e = entry(i);
+    e.prev = NIL;
+    e.next = l.head;
+    if (l.head != NIL) entry(l.head).prev = i;
+    l.head = i;
+    if (l.tail == NIL) l.tail = i;
+    l.size++;
+}
+
+// Move key to front (most recently used) of its own region.
+void ShardedLRUCache::Shard::lru_touch(uint32_t i) {
+    LruList &l = list_of(i);
+    if (l.head == i) return;
+    lru_unlink(i);
+    lru_push_front(l, i);
+}
+
+// Return an unlinked entry to the free list and retire its blob.
+void ShardedLRUCache::Shard::release(uint32_t i) {
+    Entry &e = entry(i);
+    Blob *b = e.blob.load(std::memory_order_relaxed);
+    e.blob.store(nullptr, std::memory_order_release);
+    bytes -= entry_charge(b->klen, b->vlen);
+    retire(b);
+
+    timer_remove(i);
+    e.hash = 0;
+    e.ref.store(0, std::memory_order_relaxed);
+    e.window = false;
+    e.prev = NIL;
+    e.next = free_head;
+    free_head = i;
+    count--;
+}
+
+// Drop a used entry from table and lists. Caller holds the write side.
+void ShardedLRUCache::Shard::evict(uint32_t i) {
+    erase_slot(slot_of(i));
+    lru_unlink(i);
+    release(i);
+}
+
+void ShardedLRUCache::Shard::remove(std::string_view key, uint64_t h) {
+    size_t pos = probe(key, h);
+    uint32_t i = slot_idx(table.load(std::memory_order_relaxed)->slots()[pos]
+                              .load(std::memory_order_relaxed));
+    if (i == NIL) return;
+
+    write_begin();
+    erase_slot(pos);
+    lru_unlink(i);
+    release(i);
+    write_end();
+}
+
+void ShardedLRUCache::Shard::remove_hash(uint64_t h) {
+    Table *t = table.load(std::memory_order_relaxed);
+    uint32_t tag = hash_tag(h);
+    size_t pos = home_slot(h, t->mask);
+
+    for (;;) {
+        uint64_t w = t->slots()[pos].load(std::memory_order_relaxed);
+        uint32_t i = slot_idx(w);
+        if (i == NIL)
+            return;
+        if (slot_tag(w) == tag && entry(i).blob.load(std::memory_order_relaxed)->hash == h) {
+            write_begin();
+            erase_slot(pos);
+            lru_unlink(i);
+            release(i);
+            write_end();
+            return;
+        }
+        pos = (pos + 1) & t->mask;
+    }
+}
+
+// Evict i to make room. With a spill tier the blob is pinned and queued
+// for this thread to write out once it has let go of the shard lock.
+void ShardedLRUCache::Shard::drop(uint32_t i) {
+    evictions.fetch_add(1, std::memory_order_relaxed);
+    if (spill) {
+        Blob *b = entry(i).blob.load(std::memory_order_relaxed);
+        b->pins.fetch_add(1, std::memory_order_acq_rel);
+        spill_victims().push_back({b, spill->version(b->hash)});
+    }
+    evict(i);
+}
+
+// Victim from the main region, which must not be empty. The CLOCK sweep
+// ends after at most two passes over the main entries.
+uint32_t ShardedLRUCache::Shard::pick_victim(EvictionPolicy policy) {
+    if (policy == EvictionPolicy::LRU)
+        return lru.tail;
+
+    for (;;) {
+        uint32_t i = hand;
+        hand = (hand + 1 >= next_unused) ? 0 : hand + 1;
+
+        Entry &e = entry(i);
+        if (!e.blob.load(std::memory_order_relaxed) || e.window) continue;
+        if (e.ref.load(std::memory_order_relaxed)) {
+            e.ref.store(0, std::memory_order_relaxed);
+            continue;
+        }
+        return i;
+    }
+}
+
+// Free one entry in a full shard. Without admission the main victim
+// goes. With it, the oldest window entry is the candidate: it replaces
+// the main victim only if the sketch has seen it more often.
+void ShardedLRUCache::Shard::make_room(EvictionPolicy policy) {
+    if (window_cap == 0 || window.size == 0) {
+        drop(pick_victim(policy));
+        return;
+    }
+
+    uint32_t cand = window.tail;
+    if (lru.size == 0) {
+        drop(cand);
+        return;
+    }
+
+    uint32_t victim = pick_victim(policy);
+    if (sketch->frequency(entry(cand).hash) > sketch->frequency(entry(victim).hash)) {
+        drop(victim);
+        lru_unlink(cand);
+        entry(cand).window = false;
+        lru_push_front(lru, cand);
+        admitted.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        drop(cand);
+        rejected.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// File entry i under the deadline tick. An entry due later than the top
+// ring reaches is parked in its furthest bucket and re-filed on cascade.
+void ShardedLRUCache::Shard::timer_add(uint32_t i, uint64_t tick) {
+    constexpr unsigned BITS = TimerWheel::BITS;
+    constexpr unsigned LEVELS = TimerWheel::LEVELS;
+
+    if (tick < wheel.tick) tick = wheel.tick;
+    uint64_t delta = tick - wheel.tick;
+    if (delta >> (BITS * LEVELS)) {
+        tick = wheel.tick + (1ull << (BITS * LEVELS)) - 1;
+        delta = tick - wheel.tick;
+    }
+
+    unsigned level = 0;
+    while (level + 1 < LEVELS && delta >> (BITS * (level + 1)))
+        level++;
+    uint16_t b = (uint16_t)(level * TimerWheel::SLOTS +
+                            ((tick >> (BITS * level)) & (TimerWheel::SLOTS - 1)));
+
+    Entry &e = entry(i);
+    e.timer = b;
+    e.tprev = NIL;
+    e.tnext = wheel.buckets[b];
+    if (e.tnext != NIL) entry(e.tnext).tprev = i;
+    wheel.buckets[b] = i;
+    wheel.count++;
+}
+
+void ShardedLRUCache::Shard::timer_remove(uint32_t i) {
+    Entry &e = entry(i);
+    if (e.timer == NO_TIMER) return;
+    if (e.tprev != NIL) entry(e.tprev).tnext = e.tnext;
+    else wheel.buckets[e.timer] = e.tnext;
+    if (e.tnext != NIL) entry(e.tnext).tprev = e.tprev;
+    e.timer = NO_TIMER;
+    e.tprev = e.tnext = NIL;
+    wheel.count--;
+}
+
+size_t ShardedLRUCache::Shard::expire(uint64_t now) {
+    constexpr unsigned BITS = TimerWheel::BITS;
+    constexpr uint64_t SLOT_MASK = TimerWheel::SLOTS - 1;
+
+    uint64_t target = now / TICK_MS;
+    if (wheel.count == 0) {
+        if (wheel.tick <= target) wheel.tick = target + 1;
+        return 0;
+    }
+
+    size_t n = 0;
+    bool writing = false;
+
+    // unhook a bucket; its entries are re-filed or evicted one by one
+    auto take = [&](unsigned b) {
+        uint32_t head = wheel.buckets[b];
+        wheel.buckets[b] = NIL;
+        for (uint32_t i = head; i != NIL; i = entry(i).tnext) {
+            entry(i).timer = NO_TIMER;
+            wheel.count--;
+        }
+        return head;
+    };
+
+    for (; wheel.tick <= target; wheel.tick++) {
+        uint64_t t = wheel.tick;
+
+        // entering a new span of a coarser ring: move its bucket down
+        for (unsigned level = 1; level < TimerWheel::LEVELS; level++) {
+            if (t & ((1ull << (BITS * level)) - 1)) break;
+            unsigned b = level * TimerWheel::SLOTS + ((t >> (BITS * level)) & SLOT_MASK);
+            for (uint32_t i = take(b), next; i != NIL; i = next) {
+                next = entry(i).tnext;
+                timer_add(i, deadline_tick(entry(i).blob.load(std::memory_order_relaxed)->expires));
+            }
+        }
+
+        for (uint32_t i = take(t & SLOT_MASK), next; i != NIL; i = next) {
+            next = entry(i).tnext;
+            uint64_t expires = entry(i).blob.load(std::memory_order_relaxed)->expires;
+            if (expires > now) {
+                timer_add(i, deadline_tick(expires));
+                continue;
+            }
+            if (!writing) {
+                write_begin();
+                writing = true;
+            }
+            evict(i);
+            n++;
+        }
+    }
+
+    if (writing) write_end();
+    expired.fetch_add(n, std::memory_order_relaxed);
+    return n;
+}
+
+void ShardedLRUCache::Shard::retire(Blob *b, Table *t) {
+    retired.push_back({b, t, EpochDomain::instance().retire_epoch()});
+    if (retired.size() >= RECLAIM_BATCH)
+        reclaim();
+}
+
+void ShardedLRUCache::Shard::reclaim() {
+    uint64_t bound = EpochDomain::instance().reclaim_bound();
+    auto keep = std::partition(retired.begin(), retired.end(), [&](const Retired &r) {
+        return r.epoch >= bound ||
+               (r.blob && r.blob->pins.load(std::memory_order_acquire) != 0);
+    });
+    for (auto it = keep; it != retired.end(); ++it) {
+        if (it->blob) free_blob(it->blob);
+        if (it->table) Table::destroy(it->table, node);
+    }
+    retired.erase(keep, retired.end());
+}
+
+
+static CacheOptions basic_options(size_t num_shards, size_t per_shard_capacity,
+                                  EvictionPolicy policy) {
+    CacheOptions o;
+    o.num_shards = num_shards;
+    o.per_shard_capacity = per_shard_capacity;
+    o.policy = policy;
+    return o;
+}
+
+ShardedLRUCache::ShardedLRUCache(size_t num_shards, size_t per_shard_capacity,
+                                 EvictionPolicy policy)
+    : ShardedLRUCache(basic_options(num_shards, per_shard_capacity, policy)) {}
+
+ShardedLRUCache::ShardedLRUCache(const CacheOptions &opts)
+    : per_shard_capacity_(opts.per_shard_capacity), byte_budget_(opts.byte_budget),
+      policy_(opts.policy), admission_(opts.admission),
+      default_ttl_ms_(opts.default_ttl.count() > 0 ? opts.default_ttl.count() : 0),
+      compress_min_(opts.compress_min), numa_(opts.numa),
+      expiry_interval_(opts.expiry_interval)
+{
+    id_ = next_cache_id.fetch_add(1, std::memory_order_relaxed);
+    if (opts.l1_entries) {
+        l1_entries_ = 1;
+        while (l1_entries_ < opts.l1_entries) l1_entries_ <<= 1;
+        l1_gens_.reset(new std::atomic<uint64_t>[L1_STRIPES]);
+        for (size_t i = 0; i < L1_STRIPES; i++)
+            l1_gens_[i].store(0, std::memory_order_relaxed);
+    }
+
+    // each copy of a hot key needs a shard of its own
+    hot_lanes_ = (uint32_t)std::min(opts.hot_replicas, shard_count(opts.num_shards));
+    if (hot_lanes_ > 1)
+        hot_.reset(new HotSlot[HOT_SLOTS]);
+
+    // without a usable file the cache runs without the disk tier
+    if (opts.spill_bytes) {
+        spill_ = std::make_unique<SpillCache>(opts.spill_path, opts.spill_bytes);
+        if (!spill_->ok())
+            spill_.reset();
+    }
+
+    map_.store(build_map(opts.num_shards, per_shard_capacity_, byte_budget_),
+               std::memory_order_release);
+
+    if (expiry_interval_.count() > 0)
+        expiry_thread_ = std::thread(&ShardedLRUCache::expiry_loop, this);
+}
+
+ShardedLRUCache::~ShardedLRUCache() {
+    if (resize_thread_.joinable()) {
+        resize_stop_.store(true, std::memory_order_relaxed);
+        resize_thread_.join();
+    }
+    if (expiry_thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lk(expiry_mtx_);
+            stopping_ = true;
+        }
+        expiry_cv_.notify_all();
+        expiry_thread_.join();
+    }
+
+    // a resize stopped before it let go of the old map
+    MapView v = maps();
+    delete v.old;
+    delete v.cur;
+}
+
+void ShardedLRUCache::expiry_loop() {
+    std::unique_lock<std::mutex> lk(expiry_mtx_);
+    while (!expiry_cv_.wait_for(lk, expiry_interval_, [&] { return stopping_; })) {
+        lk.unlock();
+        cache_expire();
+        lk.lock();
+    }
+}
+
+size_t ShardedLRUCache::shard_count(size_t n) {
+    size_t count = 1;
+    while (count < n) count <<= 1;
+    return count;
+}
+
+// Storage for num_shards (rounded up to a power of two) shards, which
+// build_map constructs in place. Parts are a power of two too, so the
+// part is just the top bits of the index; with more parts than nodes
+// the nodes take turns.
+ShardedLRUCache::ShardMap::ShardMap(size_t n, const std::vector<int> &node_list)
+    : num_shards(1), shift(64), num_parts(1)
+{
+    while (num_shards < n) {
+        num_shards <<= 1;
+        shift--;
+    }
+    while (num_parts < node_list.size() && num_parts < num_shards && num_parts < MAX_PARTS)
+        num_parts <<= 1;
+
+    size_t per_part = num_shards / num_parts;
+    part_shift = 0;
+    while (((size_t)1 << part_shift) < per_part) part_shift++;
+
+    for (size_t p = 0; p < num_parts; p++) {
+        nodes[p] = node_list.empty() ? -1 : node_list[p % node_list.size()];
+        parts[p] = static_cast<Shard *>(kv_node_alloc(per_part * sizeof(Shard), nodes[p]));
+    }
+}
+
+ShardedLRUCache::ShardMap::~ShardMap() {
+    for (size_t s = 0; s < num_shards; s++)
+        at(s)->~Shard();
+    for (size_t p = 0; p < num_parts; p++)
+        kv_node_free(parts[p], (num_shards / num_parts) * sizeof(Shard), nodes[p]);
+}
+
+ShardedLRUCache::ShardMap *ShardedLRUCache::build_map(size_t num_shards,
+                                                      size_t per_shard_capacity,
+                                                      size_t byte_budget) const {
+    static const std::vector<int> no_nodes;
+    ShardMap *m = new ShardMap(num_shards, numa_ ? kv_numa_nodes() : no_nodes);
+
+    // With a byte budget the entry limit is whatever the smallest
+    // possible entries would need to fill the shard's share.
+    size_t byte_cap = SIZE_MAX;
+    if (byte_budget) {
+        byte_cap = byte_budget / m->num_shards;
+        per_shard_capacity = std::min<size_t>(byte_cap / entry_charge(1, 0), NIL - 1);
+    }
+    size_t sketch_max = std::max<size_t>(1, SKETCH_MAX_KEYS / m->num_shards);
+
+    for (size_t s = 0; s < m->num_shards; s++) {
+        Shard *sh = new (m->at(s)) Shard(per_shard_capacity, byte_cap, admission_,
+                                         hot_lanes_ > 1, sketch_max, m->node_of(s));
+        sh->spill = spill_.get();
+    }
+    return m;
+}
+
+// The current map is loaded first: a resize publishes the old map before
+// the new one, so a caller that sees the new map also sees the old.
+ShardedLRUCache::MapView ShardedLRUCache::maps() const {
+    ShardMap *cur = map_.load(std::memory_order_acquire);
+    ShardMap *old = old_map_.load(std::memory_order_acquire);
+    if (old == cur)
+        old = nullptr;
+    return {old, cur, old && old->draining.load(std::memory_order_acquire)};
+}
+
+// An epoch keeps a resize from freeing the maps the operation loaded;
+// past the reader slots a shared lock does the same.
+struct ShardedLRUCache::MapGuard {
+    EpochGuard epoch;
+    std::shared_lock<std::shared_mutex> lk;
+
+    explicit MapGuard(const ShardedLRUCache &c) {
+        if (!epoch.active())
+            lk = std::shared_lock<std::shared_mutex>(c.map_mtx_);
+    }
+};
+
+// Record a hit. CLOCK only sets the reference bit; LRU relinks if the
+// lock is free and the entry still holds the blob the reader saw.
+void ShardedLRUCache::touch(Shard *sh, uint32_t i, Blob *seen) {
+    Entry &e = sh->entry(i);
+
+    if (policy_ == EvictionPolicy::CLOCK) {
+        if (!e.ref.load(std::memory_order_relaxed))
+            e.ref.store(1, std::memory_order_relaxed);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lk(sh->mtx, std::try_to_lock);
+    if (!lk.owns_lock()) {
+        sh->lock_waits.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (e.blob.load(std::memory_order_relaxed) == seen)
+        sh->lru_touch(i);
+}
+
+// Find key and call on_hit(blob) while the blob is guaranteed live. A
+// hot key is first looked for in this thread's lane; when the lane has
+// no copy yet, the home entry is read and copied there. The directory
+// word is loaded before the home read, so a write that lands in between
+// sees the key as hot and retires the version the copy is filed under.
+template <typename Fn>
+bool ShardedLRUCache::lookup(const CacheKey &key, Fn &&on_hit) {
+    if (hot_lanes_ < 2)
+        return lookup_shard(key, on_hit);
+
+    uint64_t w = hot_[key.hash & (HOT_SLOTS - 1)].word.load(std::memory_order_acquire);
+    if (!hot_match(w, key.hash)) {
+        bool hit = lookup_shard(key, on_hit);
+        if (hit && ++tls_hot_checks % HOT_CHECK_INTERVAL == 0)
+            maybe_promote(key.hash);
+        return hit;
+    }
+
+    uint32_t lane = tls_lane % hot_lanes_;
+    if (lane == 0)
+        return lookup_shard(key, on_hit);
+
+    CacheKey rk(key.str, replica_hash(key.hash, hot_version(w), lane));
+    if (lookup_replica(key.hash, rk, on_hit))
+        return true;
+
+    std::string copy;
+    uint32_t raw_len = 0;
+    uint64_t expires = 0;
+    bool hit = lookup_shard(key, [&](Blob *b) {
+        on_hit(b);
+        copy.assign(b->val(), b->vlen);
+        raw_len = b->raw_len;
+        expires = b->expires;
+    });
+
+    // no shard lock is held here, so filling another shard cannot deadlock
+    if (hit) {
+        uint64_t now = now_ms();
+        if (!expires || expires > now) {
+            put(rk, copy, raw_len, expires ? expires - now : 0);
+            // a write or takeover that erased the lanes before the copy
+            // landed moved the version first; take the copy back out
+            if (hot_[key.hash & (HOT_SLOTS - 1)].word.load(std::memory_order_acquire) != w)
+                erase(rk);
+        }
+    }
+    return hit;
+}
+
+// Lock-free probe of a hot key's copy. A hit is counted in the lane's
+// shard and as an access to the home sketch, so the key stays hot; a
+// miss is not counted, the caller goes on to the home shard. The lane's
+// own sketch sees every probe, which gets a new copy past admission.
+template <typename Fn>
+bool ShardedLRUCache::lookup_replica(uint64_t home_hash, const CacheKey &rk, Fn &&on_hit) {
+    ShardMap *m = maps().cur;
+    Shard *sh = m->shard(rk.hash);
+    if (sh->sketch)
+        sh->sketch->increment(rk.hash);
+
+    EpochGuard guard;
+    if (!guard.active())
+        return false;
+
+    Blob *b = nullptr;
+    bool stable = false;
+    uint32_t i = sh->probe_unlocked(rk.str, rk.hash, &b, &stable);
+    if (i == NIL || (b->expires && b->expires <= now_ms()))
+        return false;
+
+    on_hit(b);
+    touch(sh, i, b);
+    sh->reader().hits.fetch_add(1, std::memory_order_relaxed);
+    sh->reader().replica_hits.fetch_add(1, std::memory_order_relaxed);
+
+    Shard *home = m->shard(home_hash);
+    if (home->sketch)
+        home->sketch->increment(home_hash);
+    return true;
+}
+
+// Name of a hot key's copy in a lane: lane l lives l / lanes of the way
+// round the shard ring from home, and the version is mixed into the rest
+// of the hash, so a new version never finds an old copy. A resize
+// renames every copy, which only costs the lanes a refill.
+uint64_t ShardedLRUCache::replica_hash(uint64_t h, uint32_t version, uint32_t lane) const {
+    const ShardMap *map = maps().cur;
+    uint64_t m = kv_hash(std::string_view(reinterpret_cast<const char *>(&h), sizeof(h)),
+                         ((uint64_t)version << 8) | lane);
+    if (map->shift >= 64)
+        return m;
+    size_t s = (map->index(h) + lane * (map->num_shards / hot_lanes_)) & (map->num_shards - 1);
+    return ((uint64_t)s << map->shift) | (m & ((1ull << map->shift) - 1));
+}
+
+// Enter h in the directory if it is hot. An occupant keeps its slot
+// until its own count drops below the threshold; when it loses it, its
+// copies go, as they can no longer be reached.
+void ShardedLRUCache::maybe_promote(uint64_t h) {
+    ShardMap *m = maps().cur;
+    Shard *sh = m->shard(h);
+    if (!sh->sketch || sh->sketch->frequency(h) < HOT_FREQUENCY)
+        return;
+
+    HotSlot &slot = hot_[h & (HOT_SLOTS - 1)];
+    uint64_t w = slot.word.load(std::memory_order_relaxed);
+    if (w) {
+        uint64_t cur = slot.hash.load(std::memory_order_relaxed);
+        Shard *cs = m->shard(cur);
+        if (cs->sketch && cs->sketch->frequency(cur) >= HOT_FREQUENCY)
+            return;
+    }
+
+    uint64_t old = slot.hash.load(std::memory_order_relaxed);
+    uint32_t v = (uint32_t)(hot_versions_.fetch_add(1, std::memory_order_relaxed) + 1);
+    if (slot.word.compare_exchange_strong(w, hot_word(h, v ? v : 1))) {
+        slot.hash.store(h, std::memory_order_relaxed);
+        // old is stale if another takeover is still storing its hash;
+        // then that one's copies are left for eviction
+        if (hot_match(w, old))
+            erase_copies(old, hot_version(w));
+    }
+}
+
+// Called after every write to key. The fence orders the write before the
+// directory load against a reader that loaded the directory first and
+// is about to copy the home entry (see lookup).
+void ShardedLRUCache::invalidate_hot(const CacheKey &key) {
+    if (hot_lanes_ < 2)
+        return;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    HotSlot &slot = hot_[key.hash & (HOT_SLOTS - 1)];
+    uint64_t w = slot.word.load(std::memory_order_acquire);
+    while (hot_match(w, key.hash)) {
+        uint32_t v = (uint32_t)(hot_versions_.fetch_add(1, std::memory_order_relaxed) + 1);
+        if (slot.word.compare_exchange_weak(w, hot_word(key.hash, v ? v : 1))) {
+            erase_copies(key.hash, hot_version(w));
+            return;
+        }
+    }
+}
+
+// Drop the lane copies of h filed under version. They are found by hash
+// alone, as a takeover only knows the displaced key's hash; copy hashes
+// mix in the version, so no other entry shares one. Both maps during a
+// resize, as in erase.
+void ShardedLRUCache::erase_copies(uint64_t h, uint32_t version) {
+    for (uint32_t lane = 1; lane < hot_lanes_; lane++) {
+        uint64_t rh = replica_hash(h, version, lane);
+        MapView v = maps();
+        Shard *sh = v.cur->shard(rh);
+        if (!v.old) {
+            std::unique_lock<std::mutex> lk = sh->lock();
+            sh->remove_hash(rh);
+            continue;
+        }
+        Shard *osh = v.old->shard(rh);
+        std::unique_lock<std::mutex> lk = osh->lock();
+        {
+            std::unique_lock<std::mutex> clk = sh->lock();
+            sh->remove_hash(rh);
+        }
+        osh->remove_hash(rh);
     }
 }
 
-size_t ShardedLRUCache::shard_index(const std::string &key) const {
-    return std::hash<std::string>{}(key) % num_shards_;
+// Look key up in its own shard. While a resize drains the old map the
+// key is looked for there first: entries only ever move from the old map
+// to the new one, so checking in that order cannot miss one in transit.
+template <typename Fn>
+bool ShardedLRUCache::lookup_shard(const CacheKey &key, Fn &&on_hit) {
+    MapView v = maps();
+    if (v.old && lookup_in(v.old->shard(key.hash), key, on_hit, false))
+        return true;
+    return lookup_in(v.cur->shard(key.hash), key, on_hit, true);
+}
+
+// Look key up in sh. Lock-free inside an epoch guard, under the shard
+// lock on the fallback. Counts the access for admission and the hit
+// stats, and a miss if count_miss. An entry past its TTL is a miss; only
+// the locked path removes it.
+template <typename Fn>
+bool ShardedLRUCache::lookup_in(Shard *sh, const CacheKey &key, Fn &&on_hit,
+                                bool count_miss) {
+    uint64_t h = key.hash;
+    auto miss = [&] {
+        if (count_miss)
+            sh->reader().misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    };
+
+    // every lookup counts as an access, hit or miss
+    if (sh->sketch)
+        sh->sketch->increment(h);
+    if (sh->node >= 0)
+        sh->count_access();
+
+    {
+        EpochGuard guard;
+        if (guard.active()) {
+            for (int attempt = 0; attempt < READ_RETRIES; attempt++) {
+                Blob *b = nullptr;
+                bool stable = false;
+                uint32_t i = sh->probe_unlocked(key.str, h, &b, &stable);
+                if (i != NIL && b->expires && b->expires <= now_ms())
+                    return miss();
+                if (i != NIL) {
+                    on_hit(b);
+                    touch(sh, i, b);
+                    sh->reader().hits.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+                if (stable)
+                    return miss();
+            }
+        }
+    }
+
+    std::unique_lock<std::mutex> lk = sh->lock();
+
+    Table *t = sh->table.load(std::memory_order_relaxed);
+    uint32_t i = slot_idx(t->slots()[sh->probe(key.str, h)].load(std::memory_order_relaxed));
+    if (i == NIL)
+        return miss();
+
+    Entry &e = sh->entry(i);
+    uint64_t expires = e.blob.load(std::memory_order_relaxed)->expires;
+    if (expires && expires <= now_ms()) {
+        sh->write_begin();
+        sh->evict(i);
+        sh->write_end();
+        sh->expired.fetch_add(1, std::memory_order_relaxed);
+        return miss();
+    }
+
+    if (policy_ == EvictionPolicy::CLOCK)
+        e.ref.store(1, std::memory_order_relaxed);
+    else
+        sh->lru_touch(i);
+    sh->reader().hits.fetch_add(1, std::memory_order_relaxed);
+
+    on_hit(e.blob.load(std::memory_order_relaxed));
+    return true;
 }
 
 
-bool ShardedLRUCache::cache_get(const std::string &key, std::string &value) {
-    size_t s = shard_index(key);
-    Shard *sh = shards_[s].get();
-    std::lock_guard<std::mutex> lk(sh->mtx);
+CacheL1Slot *ShardedLRUCache::l1_slot(uint64_t h) {
+    if (!l1_entries_)
+        return nullptr;
+    if (tls_l1.size() <= id_)
+        tls_l1.resize(id_ + 1);
+    std::unique_ptr<CacheL1> &t = tls_l1[id_];
+    if (!t)
+        t = std::make_unique<CacheL1>(l1_entries_);
+    return &t->slots[h & t->mask];
+}
+
+std::atomic<uint64_t> &ShardedLRUCache::l1_gen(uint64_t h) {
+    return l1_gens_[h & (L1_STRIPES - 1)];
+}
 
-    auto it = sh->map.find(key);
-    if (it == sh->map.end())
+bool ShardedLRUCache::l1_valid(CacheL1Slot &s, const CacheKey &key, uint64_t gen) {
+    if (s.hash != key.hash || s.gen != gen || s.uses >= L1_MAX_USES ||
+        (s.expires && s.expires <= now_ms()) || s.key != key.str)
         return false;
+    s.uses++;
+    return true;
+}
+
+// value is the plain value of a blob found by a lookup. gen must have
+// been loaded before that lookup, so a write racing it leaves the copy
+// already stale.
+void ShardedLRUCache::l1_fill(CacheL1Slot &s, const CacheKey &key, uint64_t gen,
+                              std::string_view value, uint64_t expires) {
+    if (value.size() > L1_MAX_VALUE || s.handles.load(std::memory_order_acquire) != 0)
+        return;
+    s.hash = key.hash;
+    s.gen = gen;
+    s.expires = expires;
+    s.uses = 0;
+    s.key.assign(key.str);
+    s.value.assign(value);
+}
+
+void ShardedLRUCache::l1_count_hit() {
+    CacheL1 &t = *tls_l1[id_];
+    if (++t.pending_hits == L1_HIT_BATCH) {
+        l1_hits_.fetch_add(L1_HIT_BATCH, std::memory_order_relaxed);
+        t.pending_hits = 0;
+    }
+}
+
+// After a write: void every thread's copy of keys in key's stripe.
+void ShardedLRUCache::l1_invalidate(const CacheKey &key) {
+    if (l1_entries_)
+        l1_gen(key.hash).fetch_add(1, std::memory_order_release);
+}
+
+
+bool ShardedLRUCache::cache_get(const CacheKey &key, std::string &value) {
+    CacheL1Slot *s = l1_slot(key.hash);
+    uint64_t gen = 0;
+    if (s) {
+        gen = l1_gen(key.hash).load(std::memory_order_acquire);
+        if (l1_valid(*s, key, gen)) {
+            value = s->value;
+            l1_count_hit();
+            return true;
+        }
+    }
+
+    // a compressed blob is pinned and inflated after the lookup, outside
+    // the epoch guard and the shard lock
+    Blob *packed = nullptr;
+    MapGuard guard(*this);
+    auto on_hit = [&](Blob *b) {
+        if (b->compressed()) {
+            b->pins.fetch_add(1, std::memory_order_acq_rel);
+            packed = b;
+            return;
+        }
+        value.assign(b->val(), b->vlen);
+        if (s) l1_fill(*s, key, gen, value, b->expires);
+    };
+    bool hit = lookup(key, on_hit) || (unspill(key) && lookup(key, on_hit));
+    if (!packed)
+        return hit;
+
+    value.resize(packed->raw_len);
+    bool ok = gzip_decode(std::string_view(packed->val(), packed->vlen),
+                          &value[0], packed->raw_len);
+    if (ok && s) l1_fill(*s, key, gen, value, packed->expires);
+    packed->pins.fetch_sub(1, std::memory_order_acq_rel);
+    return ok;
+}
 
-    // Move key to front (most recently used)
-    sh->lru_list.erase(it->second.second);
-    sh->lru_list.push_front(key);
-    it->second.second = sh->lru_list.begin();
+bool ShardedLRUCache::cache_get(const CacheKey &key, CacheHandle &handle,
+                                bool accept_gzip) {
+    handle.reset();
 
-    value = it->second.first;
+    CacheL1Slot *s = l1_slot(key.hash);
+    uint64_t gen = 0;
+    if (s) {
+        gen = l1_gen(key.hash).load(std::memory_order_acquire);
+        if (l1_valid(*s, key, gen)) {
+            s->handles.fetch_add(1, std::memory_order_relaxed);
+            handle.pins_ = &s->handles;
+            handle.value_ = s->value;
+            l1_count_hit();
+            return true;
+        }
+    }
+
+    MapGuard guard(*this);
+    Blob *found = nullptr;
+    auto on_hit = [&](Blob *b) {
+        b->pins.fetch_add(1, std::memory_order_acq_rel);
+        handle.pins_ = &b->pins;
+        handle.value_ = std::string_view(b->val(), b->vlen);
+        found = b;
+    };
+    bool hit = lookup(key, on_hit) || (unspill(key) && lookup(key, on_hit));
+    if (!hit)
+        return false;
+
+    // the pin keeps the blob alive from here on
+    if (found->compressed()) {
+        if (accept_gzip) {
+            handle.gzipped_ = true;
+            return true;
+        }
+        handle.decoded_.resize(found->raw_len);
+        if (!gzip_decode(handle.value_, &handle.decoded_[0], found->raw_len)) {
+            handle.reset();
+            return false;
+        }
+        handle.value_ = handle.decoded_;
+    }
+    if (s) l1_fill(*s, key, gen, handle.value_, found->expires);
     return true;
 }
 
 
-void ShardedLRUCache::cache_put(const std::string &key, const std::string &value) {
-    size_t s = shard_index(key);
-    Shard *sh = shards_[s].get();
-    std::lock_guard<std::mutex> lk(sh->mtx);
+// Stored form of a value: gzipped when that is enabled, the value is big
+// enough and compression pays off. The result may view a per-thread
+// buffer that the next call reuses.
+std::string_view ShardedLRUCache::encode(std::string_view value) const {
+    static thread_local std::string packed;
+    if (compress_min_ && value.size() >= compress_min_ && gzip_encode(value, packed))
+        return packed;
+    return value;
+}
+
+void ShardedLRUCache::cache_put(const CacheKey &key, std::string_view value) {
+    cache_put(key, value, std::chrono::milliseconds(default_ttl_ms_));
+}
+
+void ShardedLRUCache::cache_put(const CacheKey &key, std::string_view value,
+                                std::chrono::milliseconds ttl) {
+    MapGuard guard(*this);
+    if (spill_) spill_->begin_write(key.hash);
+    put(key, encode(value), (uint32_t)value.size(), ttl.count() > 0 ? ttl.count() : 0);
+    if (spill_) spill_->end_write(key.hash);
+    invalidate_hot(key);
+    l1_invalidate(key);
+}
+
+void ShardedLRUCache::cache_fill(const CacheKey &key, std::string_view value,
+                                 const std::atomic<uint64_t> &gen, uint64_t seen) {
+    MapGuard guard(*this);
+    if (spill_) spill_->begin_write(key.hash);
+    put(key, encode(value), (uint32_t)value.size(), default_ttl_ms_, nullptr, &gen, seen);
+    if (spill_) spill_->end_write(key.hash);
+    invalidate_hot(key);
+    l1_invalidate(key);
+}
+
+// With spill_version set this promotes a copy read from the spill tier
+// when that version was current. During a resize writes stay in the old
+// map until it is draining; then the old copy is only dropped once the
+// new one is in, so readers, who look in the old map first, always find
+// one of them, and the old shard's lock keeps the drain from moving the
+// old copy over the new one in between. With gen set it is a fill that
+// only goes ahead while gen still reads gen_seen.
+void ShardedLRUCache::put(const CacheKey &key, std::string_view stored, uint32_t raw_len,
+                          uint64_t ttl_ms, const uint64_t *spill_version,
+                          const std::atomic<uint64_t> *gen, uint64_t gen_seen) {
+    MapView v = maps();
+    uint64_t expires = ttl_ms ? now_ms() + ttl_ms : 0;
+    Shard *sh = v.cur->shard(key.hash);
+    if (!v.old) {
+        put_in(sh, key, stored, raw_len, expires, spill_version, gen, gen_seen);
+    } else if (!v.draining) {
+        put_in(v.old->shard(key.hash), key, stored, raw_len, expires, spill_version, gen, gen_seen);
+    } else {
+        Shard *osh = v.old->shard(key.hash);
+        std::unique_lock<std::mutex> lk = osh->lock();
+        put_in(sh, key, stored, raw_len, expires, spill_version, gen, gen_seen);
+        osh->remove(key.str, key.hash);
+    }
+
+    // the shard lock is released by now
+    if (spill_) spill_out();
+}
+
+// Store key in sh. expires is a steady-clock deadline, 0 if none.
+void ShardedLRUCache::put_in(Shard *sh, const CacheKey &key, std::string_view stored,
+                             uint32_t raw_len, uint64_t expires,
+                             const uint64_t *spill_version,
+                             const std::atomic<uint64_t> *gen, uint64_t gen_seen) {
+    uint64_t h = key.hash;
+    if (sh->capacity == 0) return;
+    if (gen && gen->load(std::memory_order_acquire) != gen_seen)
+        return;
+    if (sh->node >= 0)
+        sh->count_access();
+
+    // A value that can never fit must still not leave an old copy behind.
+    size_t charge = entry_charge(key.str.size(), stored.size());
+    if (charge > sh->byte_cap) {
+        erase_in(sh, key);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lk = sh->lock();
+    sh->expire(now_ms());
+
+    size_t pos = sh->probe(key.str, h);
+    uint32_t i = slot_idx(sh->table.load(std::memory_order_relaxed)->slots()[pos]
+                              .load(std::memory_order_relaxed));
 
-    auto it = sh->map.find(key);
-    if (it != sh->map.end()) {
-        // update existing
-        sh->lru_list.erase(it->second.second);
-        sh->lru_list.push_front(key);
-        it->second = {value, sh->lru_list.begin()};
+    // a write since the spill read, or a copy already back, wins
+    if (spill_version && (i != NIL || spill_->version(h) != *spill_version))
+        return;
+    // as does a write since the caller's read
+    if (gen && gen->load(std::memory_order_acquire) != gen_seen)
+        return;
+
+    Blob *nb = sh->make_blob(key.str, h, stored, raw_len, expires);
+    if (i != NIL) {
+        // update existing: swap the blob, the table does not change
+        Entry &e = sh->entry(i);
+        Blob *old = e.blob.load(std::memory_order_relaxed);
+        e.blob.store(nb, std::memory_order_release);
+        sh->bytes += charge - entry_charge(old->klen, old->vlen);
+        sh->retire(old);
+        sh->updates.fetch_add(1, std::memory_order_relaxed);
+
+        sh->timer_remove(i);
+        if (expires)
+            sh->timer_add(i, deadline_tick(expires));
+
+        if (policy_ == EvictionPolicy::CLOCK)
+            e.ref.store(1, std::memory_order_relaxed);
+        else
+            sh->lru_touch(i);
+
+        // a larger value may push the shard over its budget
+        if (sh->bytes > sh->byte_cap) {
+            sh->write_begin();
+            while (sh->bytes > sh->byte_cap)
+                sh->make_room(policy_);
+            sh->write_end();
+        }
         return;
     }
 
-    // evict if full
-    if (sh->map.size() >= sh->capacity) {
-        std::string old = sh->lru_list.back();
-        sh->lru_list.pop_back();
-        sh->map.erase(old);
+    sh->write_begin();
+
+    // evict until the new entry fits
+    if (sh->count >= sh->capacity || sh->bytes + charge > sh->byte_cap) {
+        while (sh->count >= sh->capacity || sh->bytes + charge > sh->byte_cap)
+            sh->make_room(policy_);
+
+        // the shift may have moved our empty slot
+        pos = sh->probe(key.str, h);
+    }
+
+    Table *t = sh->table.load(std::memory_order_relaxed);
+    if ((sh->count + 1) * 2 > t->mask + 1) {
+        sh->grow_table();
+        pos = sh->probe(key.str, h);
+        t = sh->table.load(std::memory_order_relaxed);
     }
 
     // insert
-    sh->lru_list.push_front(key);
-    sh->map.emplace(key, std::make_pair(value, sh->lru_list.begin()));
+    i = sh->alloc_entry();
+    Entry &e = sh->entry(i);
+
+    e.hash = h;
+    e.blob.store(nb, std::memory_order_release);
+    e.window = sh->window_cap > 0;
+    sh->lru_push_front(sh->list_of(i), i);
+    t->slots()[pos].store(slot_pack(hash_tag(h), i), std::memory_order_release);
+    sh->count++;
+    sh->bytes += charge;
+    sh->inserts.fetch_add(1, std::memory_order_relaxed);
+    if (expires)
+        sh->timer_add(i, deadline_tick(expires));
+
+    // window overflow while main still has room: promote without a contest
+    if (sh->window.size > sh->window_cap) {
+        uint32_t w = sh->window.tail;
+        sh->lru_unlink(w);
+        sh->entry(w).window = false;
+        sh->lru_push_front(sh->lru, w);
+    }
+
+    sh->write_end();
+}
+
+
+// Entries this thread evicted while it held a shard lock, waiting for
+// spill_out.
+std::vector<ShardedLRUCache::SpillVictim> &ShardedLRUCache::spill_victims() {
+    static thread_local std::vector<SpillVictim> victims;
+    return victims;
+}
+
+// Write this thread's evicted entries to the spill tier and unpin them.
+// Hot-key copies stay out: they are filed under a derived hash.
+void ShardedLRUCache::spill_out() {
+    std::vector<SpillVictim> &victims = spill_victims();
+    if (victims.empty()) return;
+
+    uint64_t now = now_ms();
+    for (const SpillVictim &v : victims) {
+        Blob *b = v.blob;
+        std::string_view k(b->key(), b->klen);
+        bool copy = hot_lanes_ > 1 && b->hash != kv_hash(k);
+        if (!copy && (!b->expires || b->expires > now))
+            spill_->put(k, b->hash, std::string_view(b->val(), b->vlen), b->raw_len,
+                        b->expires, v.version);
+        b->pins.fetch_sub(1, std::memory_order_acq_rel);
+    }
+    victims.clear();
+}
+
+// After a miss in memory: copy key back from the spill tier. True if it
+// was found, for the caller to look it up again.
+bool ShardedLRUCache::unspill(const CacheKey &key) {
+    if (!spill_) return false;
+
+    // taken before the read; a write in progress means no promotion
+    uint64_t version = spill_->version(key.hash);
+    if (!SpillCache::stable(version))
+        return false;
+
+    static thread_local std::string stored;
+    uint32_t raw_len;
+    uint64_t expires;
+    uint64_t now = now_ms();
+    if (!spill_->get(key.str, key.hash, now, stored, &raw_len, &expires))
+        return false;
+
+    put(key, stored, raw_len, expires ? expires - now : 0, &version);
+    return true;
 }
 
 
-void ShardedLRUCache::cache_delete(const std::string &key) {
-    size_t s = shard_index(key);
-    Shard *sh = shards_[s].get();
-    std::lock_guard<std::mutex> lk(sh->mtx);
+void ShardedLRUCache::cache_delete(const CacheKey &key) {
+    MapGuard guard(*this);
+    if (spill_) spill_->begin_write(key.hash);
+    erase(key);
+    if (spill_) spill_->end_write(key.hash);
+    invalidate_hot(key);
+    l1_invalidate(key);
+}
 
-    auto it = sh->map.find(key);
-    if (it == sh->map.end()) return;
+// Both maps during a resize, under the old shard's lock as in put.
+void ShardedLRUCache::erase(const CacheKey &key) {
+    MapView v = maps();
+    Shard *sh = v.cur->shard(key.hash);
+    if (!v.old) {
+        erase_in(sh, key);
+        return;
+    }
+    Shard *osh = v.old->shard(key.hash);
+    std::unique_lock<std::mutex> lk = osh->lock();
+    erase_in(sh, key);
+    osh->remove(key.str, key.hash);
+}
 
-    sh->lru_list.erase(it->second.second);
-    sh->map.erase(it);
+void ShardedLRUCache::erase_in(Shard *sh, const CacheKey &key) {
+    std::unique_lock<std::mutex> lk = sh->lock();
+    sh->remove(key.str, key.hash);
 }
 
 
 void ShardedLRUCache::cache_display() {
-    for (size_t s = 0; s < num_shards_; s++) {
-        Shard *sh = shards_[s].get();
-        std::lock_guard<std::mutex> lk(sh->mtx);
+    MapGuard guard(*this);
+    MapView v = maps();
+    for (ShardMap *m : {v.old, v.cur}) {
+        if (!m) continue;
+        if (m == v.old) std::cout << "Resizing from:\n";
+        for (size_t s = 0; s < m->num_shards; s++) {
+            Shard *sh = m->at(s);
+            std::unique_lock<std::mutex> lk = sh->lock();
 
-        std::cout << "Shard " << s << " (" << sh->map.size() << " items): ";
-        for (auto &k : sh->lru_list)
-            std::cout << k << "  ";
-        std::cout << "\n";
+            std::cout << "Shard " << s << " (" << sh->count.load() << " items): ";
+            for (const LruList *l : {&sh->window, &sh->lru}) {
+                for (uint32_t i = l->head; i != NIL; i = sh->entry(i).next) {
+                    Blob *b = sh->entry(i).blob.load(std::memory_order_relaxed);
+                    std::cout.write(b->key(), b->klen) << "  ";
+                }
+            }
+            std::cout << "\n";
+        }
     }
 }
 
 
 size_t ShardedLRUCache::cache_size() {
+    MapGuard guard(*this);
+    MapView v = maps();
     size_t total = 0;
-    for (size_t s = 0; s < num_shards_; s++) {
-        Shard *sh = shards_[s].get();
-        std::lock_guard<std::mutex> lk(sh->mtx);
-        total += sh->map.size();
+    for (ShardMap *m : {v.old, v.cur}) {
+        if (!m) continue;
+        for (size_t s = 0; s < m->num_shards; s++)
+            total += m->at(s)->count.load(std::memory_order_relaxed);
     }
     return total;
 }
+
+
+size_t ShardedLRUCache::cache_expire() {
+    MapGuard guard(*this);
+    MapView v = maps();
+    uint64_t now = now_ms();
+    size_t n = 0;
+    for (ShardMap *m : {v.old, v.cur}) {
+        if (!m) continue;
+        for (size_t s = 0; s < m->num_shards; s++) {
+            Shard *sh = m->at(s);
+            std::unique_lock<std::mutex> lk = sh->lock();
+            n += sh->expire(now);
+        }
+    }
+    return n;
+}
+
+
+// Snapshot layout, host byte order: SnapHeader, one SnapSection per
+// shard, then the sections. A section is a run of records, each a
+// SnapRecord followed by the key and value bytes, coldest first.
+// Deadlines are stored in wall-clock time so they survive a restart.
+static constexpr char SNAP_MAGIC[8] = {'K', 'V', 'S', 'N', 'A', 'P', '\0', '\0'};
+static constexpr uint32_t SNAP_VERSION = 2;
+
+struct SnapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sections;
+    int64_t created_ms;           // wall clock
+};
+
+struct SnapSection {
+    uint64_t offset;               // from the start of the file
+    uint64_t bytes;
+    uint64_t records;
+};
+
+// Values are stored as cached, so compressed ones stay compressed.
+struct SnapRecord {
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t raw_len;              // == vlen unless gzipped
+    uint32_t unused;
+    int64_t expires_ms;            // wall clock, 0 if no TTL
+};
+
+// Serialize a shard's live entries, coldest first: main region from its
+// tail, then the window, which holds the newest keys. CLOCK keeps the
+// main list in insertion order, so entries with the reference bit set
+// go after the rest (LRU never sets it).
+void ShardedLRUCache::dump_shard(Shard *sh, std::string &out, uint64_t *records) {
+    std::unique_lock<std::mutex> lk = sh->lock();
+    uint64_t now = now_ms();
+    int64_t wall = wall_ms();
+
+    const struct { const LruList *list; uint8_t ref; } passes[] = {
+        {&sh->lru, 0}, {&sh->lru, 1}, {&sh->window, 0}, {&sh->window, 1}
+    };
+    for (const auto &pass : passes) {
+        for (uint32_t i = pass.list->tail; i != NIL; i = sh->entry(i).prev) {
+            Entry &e = sh->entry(i);
+            Blob *b = e.blob.load(std::memory_order_relaxed);
+            if (e.ref.load(std::memory_order_relaxed) != pass.ref ||
+                (b->expires && b->expires <= now))
+                continue;
+            // hot-key copies are filed under a derived hash; skip them
+            if (hot_lanes_ > 1 && b->hash != kv_hash(std::string_view(b->key(), b->klen)))
+                continue;
+
+            SnapRecord r;
+            r.klen = b->klen;
+            r.vlen = b->vlen;
+            r.raw_len = b->raw_len;
+            r.unused = 0;
+            r.expires_ms = b->expires ? wall + (int64_t)(b->expires - now) : 0;
+            out.append(reinterpret_cast<const char *>(&r), sizeof(r));
+            out.append(b->key(), b->klen + b->vlen);
+            (*records)++;
+        }
+    }
+}
+
+bool ShardedLRUCache::cache_dump(const std::string &path) {
+    std::lock_guard<std::mutex> dlk(dump_mtx_);
+    std::string tmp = path + ".tmp";
+    std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+    if (!f) return false;
+
+    // mid-resize, the old map goes first: a key moved while the new map
+    // is written is then stored twice rather than not at all
+    MapGuard guard(*this);
+    MapView v = maps();
+    std::vector<Shard *> shards;
+    for (ShardMap *m : {v.old, v.cur}) {
+        if (!m) continue;
+        for (size_t s = 0; s < m->num_shards; s++)
+            shards.push_back(m->at(s));
+    }
+
+    SnapHeader h;
+    std::memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.version = SNAP_VERSION;
+    h.sections = (uint32_t)shards.size();
+    h.created_ms = wall_ms();
+
+    std::vector<SnapSection> secs(shards.size());
+    uint64_t off = sizeof(h) + secs.size() * sizeof(SnapSection);
+    f.seekp(off);
+
+    std::string buf;
+    for (size_t s = 0; s < shards.size(); s++) {
+        buf.clear();
+        secs[s].records = 0;
+        dump_shard(shards[s], buf, &secs[s].records);
+        secs[s].offset = off;
+        secs[s].bytes = buf.size();
+        f.write(buf.data(), buf.size());
+        off += buf.size();
+    }
+
+    f.seekp(0);
+    f.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    f.write(reinterpret_cast<const char *>(secs.data()), secs.size() * sizeof(SnapSection));
+    f.close();
+
+    if (!f || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Put one section's records. Walking back from the hottest record first
+// decides which fit in their shard, so an overfull snapshot loses its
+// coldest keys instead of having its hottest rejected on the way in.
+void ShardedLRUCache::load_section(const char *p, const char *end) {
+    struct Item {
+        CacheKey key;
+        std::string_view value;
+        uint32_t raw_len;
+        int64_t expires_ms;
+    };
+
+    std::vector<Item> items;
+    while (end - p >= (ptrdiff_t)sizeof(SnapRecord)) {
+        SnapRecord r;
+        std::memcpy(&r, p, sizeof(r));
+        p += sizeof(r);
+        if ((uint64_t)(end - p) < (uint64_t)r.klen + r.vlen)
+            break;
+        items.push_back({std::string_view(p, r.klen),
+                         std::string_view(p + r.klen, r.vlen), r.raw_len, r.expires_ms});
+        p += r.klen + r.vlen;
+    }
+
+    MapGuard guard(*this);
+    ShardMap *m = maps().cur;
+    int64_t wall = wall_ms();
+    std::vector<size_t> bytes(m->num_shards), count(m->num_shards);
+    std::vector<bool> keep(items.size());
+    for (size_t n = items.size(); n-- > 0;) {
+        const Item &it = items[n];
+        if (it.expires_ms && it.expires_ms <= wall)
+            continue;
+        size_t s = m->index(it.key.hash);
+        size_t charge = entry_charge(it.key.str.size(), it.value.size());
+        if (count[s] >= m->at(s)->capacity || bytes[s] + charge > m->at(s)->byte_cap)
+            continue;
+        count[s]++;
+        bytes[s] += charge;
+        keep[n] = true;
+    }
+
+    for (size_t n = 0; n < items.size(); n++) {
+        if (!keep[n]) continue;
+        const Item &it = items[n];
+        if (spill_) spill_->begin_write(it.key.hash);
+        put(it.key, it.value, it.raw_len,
+            it.expires_ms ? (uint64_t)(it.expires_ms - wall) : 0);
+        if (spill_) spill_->end_write(it.key.hash);
+        invalidate_hot(it.key);
+        l1_invalidate(it.key);
+    }
+}
+
+bool ShardedLRUCache::cache_load(const std::string &path, size_t threads) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return false;
+
+    SnapHeader h;
+    if (!f.read(reinterpret_cast<char *>(&h), sizeof(h)) ||
+        std::memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != SNAP_VERSION)
+        return false;
+
+    std::vector<SnapSection> secs(h.sections);
+    if (!f.read(reinterpret_cast<char *>(secs.data()), secs.size() * sizeof(SnapSection)))
+        return false;
+    f.close();
+
+    // each loader streams whole sections through its own file handle
+    std::atomic<size_t> next{0};
+    auto loader = [&] {
+        std::ifstream in(path, std::ios::binary);
+        std::string buf;
+        for (size_t s; (s = next.fetch_add(1)) < secs.size();) {
+            buf.resize(secs[s].bytes);
+            in.seekg(secs[s].offset);
+            if (!in.read(&buf[0], buf.size()))
+                return;
+            load_section(buf.data(), buf.data() + buf.size());
+        }
+    };
+
+    threads = std::max<size_t>(1, std::min(threads, secs.size()));
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++)
+        pool.emplace_back(loader);
+    loader();
+    for (std::thread &t : pool)
+        t.join();
+    return true;
+}
+
+
+bool ShardedLRUCache::cache_resize(size_t num_shards, size_t byte_budget) {
+    std::lock_guard<std::mutex> lk(resize_mtx_);
+    if (resizing_.load(std::memory_order_relaxed))
+        return false;
+    if (resize_thread_.joinable())
+        resize_thread_.join();
+
+    ShardMap *cur = map_.load(std::memory_order_relaxed);
+    if (!num_shards)
+        num_shards = cur->num_shards;
+    if (byte_budget)
+        byte_budget_ = byte_budget;
+    else if (!byte_budget_)
+        per_shard_capacity_ = (per_shard_capacity_ * cur->num_shards + shard_count(num_shards) - 1)
+                            / shard_count(num_shards);
+
+    ShardMap *next = build_map(num_shards, per_shard_capacity_, byte_budget_);
+    resizing_.store(true, std::memory_order_relaxed);
+    old_map_.store(cur, std::memory_order_seq_cst);
+    map_.store(next, std::memory_order_seq_cst);
+    resize_thread_ = std::thread(&ShardedLRUCache::migrate, this, cur, next);
+    return true;
+}
+
+// Return once every operation that may have loaded the maps before the
+// call has finished: those in an epoch by a grace period, the others by
+// taking the map lock exclusively.
+void ShardedLRUCache::wait_for_operations() {
+    EpochDomain &d = EpochDomain::instance();
+    uint64_t e = d.retire_epoch();
+    while (d.reclaim_bound() <= e && !resize_stop_.load(std::memory_order_relaxed))
+        std::this_thread::sleep_for(MIGRATE_POLL);
+    std::unique_lock<std::shared_mutex> lk(map_mtx_);
+}
+
+// Resize thread: drain from into to, then free it. An entry is copied
+// into its new shard and evicted from the old one under the old shard's
+// lock, which writes to the key also hold (see put), so the two never
+// interleave. Writes move to the new map only once every operation
+// sees both, and the drain starts only once every operation sees that;
+// until then whatever lands in from is newer than anything in to. Lock
+// order is old shard, then new.
+void ShardedLRUCache::migrate(ShardMap *from, ShardMap *to) {
+    wait_for_operations();
+    from->draining.store(true, std::memory_order_release);
+    wait_for_operations();
+
+    for (size_t s = 0; s < from->num_shards; s++) {
+        Shard *osh = from->at(s);
+        for (bool more = true; more;) {
+            if (resize_stop_.load(std::memory_order_relaxed))
+                return;
+            {
+                std::unique_lock<std::mutex> lk = osh->lock();
+                uint64_t now = now_ms();
+
+                // main region from its tail, then the window, which
+                // holds the newest keys: the new shard sees the hottest
+                // entries last, and evicts the coldest if it is smaller
+                for (size_t n = 0; n < MIGRATE_BATCH; n++) {
+                    uint32_t i = osh->lru.tail != NIL ? osh->lru.tail : osh->window.tail;
+                    if (i == NIL) break;
+
+                    Blob *b = osh->entry(i).blob.load(std::memory_order_relaxed);
+                    std::string_view k(b->key(), b->klen);
+                    // hot-key copies are named after the old map; drop them
+                    bool copy = hot_lanes_ > 1 && b->hash != kv_hash(k);
+                    if (!copy && (!b->expires || b->expires > now)) {
+                        Shard *nsh = to->shard(b->hash);
+                        // carry the access history over for admission
+                        if (osh->sketch && nsh->sketch) {
+                            for (uint32_t f = osh->sketch->frequency(b->hash); f > 0; f--)
+                                nsh->sketch->increment(b->hash);
+                        }
+                        put_in(nsh, CacheKey(k, b->hash), std::string_view(b->val(), b->vlen),
+                               b->raw_len, b->expires, nullptr);
+                    }
+
+                    osh->write_begin();
+                    osh->evict(i);
+                    osh->write_end();
+                }
+                more = osh->count.load(std::memory_order_relaxed) > 0;
+            }
+            // what the new shards evicted for room
+            if (spill_) spill_out();
+        }
+    }
+
+    // the old counters are folded in as the map is unpublished, so the
+    // totals stay whole
+    {
+        std::lock_guard<std::mutex> lk(resize_mtx_);
+        for (size_t s = 0; s < from->num_shards; s++)
+            add_counters(drained_, from->at(s));
+        old_map_.store(nullptr, std::memory_order_seq_cst);
+    }
+    wait_for_operations();
+
+    // handles may still pin blobs the drain retired
+    for (size_t s = 0; s < from->num_shards; s++) {
+        Shard *sh = from->at(s);
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lk = sh->lock();
+                sh->reclaim();
+                if (sh->retired.empty()) break;
+            }
+            if (resize_stop_.load(std::memory_order_relaxed)) break;
+            std::this_thread::sleep_for(MIGRATE_POLL);
+        }
+    }
+
+    delete from;
+    resizing_.store(false, std::memory_order_release);
+}
+
+
+std::vector<ShardStats> ShardedLRUCache::cache_shard_stats() const {
+    MapGuard guard(*this);
+    ShardMap *m = maps().cur;
+    std::vector<ShardStats> out(m->num_shards);
+    for (size_t s = 0; s < m->num_shards; s++) {
+        const Shard *sh = m->at(s);
+        ShardStats &st = out[s];
+        for (const ReadCounters &r : sh->reads) {
+            st.hits += r.hits.load(std::memory_order_relaxed);
+            st.misses += r.misses.load(std::memory_order_relaxed);
+            st.accesses += r.accesses.load(std::memory_order_relaxed);
+            st.remote += r.remote.load(std::memory_order_relaxed);
+        }
+        st.node = sh->node;
+        st.inserts = sh->inserts.load(std::memory_order_relaxed);
+        st.updates = sh->updates.load(std::memory_order_relaxed);
+        st.evictions = sh->evictions.load(std::memory_order_relaxed);
+        st.expired = sh->expired.load(std::memory_order_relaxed);
+        st.lock_waits = sh->lock_waits.load(std::memory_order_relaxed);
+        st.entries = sh->count.load(std::memory_order_relaxed);
+        st.bytes = sh->bytes.load(std::memory_order_relaxed);
+    }
+    return out;
+}
+
+// Add the event counters of sh to st.
+void ShardedLRUCache::add_counters(CacheStats &st, const Shard *sh) {
+    for (const ReadCounters &r : sh->reads) {
+        st.hits += r.hits.load(std::memory_order_relaxed);
+        st.misses += r.misses.load(std::memory_order_relaxed);
+        st.replica_hits += r.replica_hits.load(std::memory_order_relaxed);
+        st.accesses += r.accesses.load(std::memory_order_relaxed);
+        st.remote += r.remote.load(std::memory_order_relaxed);
+    }
+    st.inserts += sh->inserts.load(std::memory_order_relaxed);
+    st.updates += sh->updates.load(std::memory_order_relaxed);
+    st.evictions += sh->evictions.load(std::memory_order_relaxed);
+    st.admitted += sh->admitted.load(std::memory_order_relaxed);
+    st.rejected += sh->rejected.load(std::memory_order_relaxed);
+    st.expired += sh->expired.load(std::memory_order_relaxed);
+    st.lock_waits += sh->lock_waits.load(std::memory_order_relaxed);
+}
+
+// Covers the map a resize is draining and the counters of those it
+// has freed, so the totals do not go back when a resize finishes.
+CacheStats ShardedLRUCache::cache_stats() {
+    MapGuard guard(*this);
+    CacheStats st;
+    MapView v;
+    {
+        std::lock_guard<std::mutex> lk(resize_mtx_);
+        st = drained_;
+        v = maps();
+    }
+    st.l1_hits = l1_hits_.load(std::memory_order_relaxed);
+    st.hits += st.l1_hits;
+
+    for (ShardMap *m : {v.old, v.cur}) {
+        if (!m) continue;
+        for (size_t s = 0; s < m->num_shards; s++) {
+            Shard *sh = m->at(s);
+            add_counters(st, sh);
+            st.entries += sh->count.load(std::memory_order_relaxed);
+            st.bytes += sh->bytes.load(std::memory_order_relaxed);
+
+            // the slab is not thread-safe; this lock is not counted as a wait
+            std::lock_guard<std::mutex> lk(sh->mtx);
+            SlabStats ss = sh->slab.stats();
+            st.mem_reserved += ss.reserved;
+            st.mem_used += ss.used;
+            st.mem_requested += ss.requested;
+        }
+    }
+    if (spill_) {
+        st.spilled = spill_->written();
+        st.spill_hits = spill_->hits();
+    }
+    return st;
+}
@@ -0,0 +1,68 @@
+#include "codec.h"
+#include <zlib.h>
+
+// windowBits + 16 selects the gzip wrapper
+static constexpr int GZIP_WINDOW_BITS = 15 + 16;
+static constexpr int GZIP_MEM_LEVEL = 8;
+
+// Per-thread streams, set up on first use. deflateInit2 allocates a few
+// hundred KB, far too much to pay on every put.
+struct ZStreams {
+    z_stream def{};
+    z_stream inf{};
+    bool def_ready = false;
+    bool inf_ready = false;
+
+    ~ZStreams() {
+        if (def_ready) deflateEnd(&def);
+        if (inf_ready) inflateEnd(&inf);
+    }
+};
+
+static thread_local ZStreams tls_z;
+
+
+bool gzip_encode(std::string_view in, std::string &out) {
+    z_stream &z = tls_z.def;
+    if (!tls_z.def_ready) {
+        if (deflateInit2(&z, Z_BEST_SPEED, Z_DEFLATED, GZIP_WINDOW_BITS,
+                         GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        tls_z.def_ready = true;
+    } else {
+        deflateReset(&z);
+    }
+
+    // output that does not fit in fewer bytes than the input is useless
+    if (in.size() < 2) return false;
+    out.resize(in.size() - 1);
+
+    z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    z.avail_in = (uInt)in.size();
+    z.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    z.avail_out = (uInt)out.size();
+
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+        return false;
+
+    out.resize(z.total_out);
+    return true;
+}
+
+bool gzip_decode(std::string_view in, char *out, size_t raw_len) {
+    z_stream &z = tls_z.inf;
+    if (!tls_z.inf_ready) {
+        if (inflateInit2(&z, GZIP_WINDOW_BITS) != Z_OK)
+            return false;
+        tls_z.inf_ready = true;
+    } else {
+        inflateReset(&z);
+    }
+
+    z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    z.avail_in = (uInt)in.size();
+    z.next_out = reinterpret_cast<Bytef *>(out);
+    z.avail_out = (uInt)raw_len;
+
+    return inflate(&z, Z_FINISH) == Z_STREAM_END && z.total_out == raw_len;
+}
@@ -0,0 +1,76 @@
+#include "epoch.h"
+
+// Per-thread reader state. The slot is claimed on the first enter() and
+// handed back when the thread exits.
+struct EpochThread {
+    int slot = -1;
+    unsigned depth = 0;
+
+    ~EpochThread() {
+        if (slot >= 0)
+            EpochDomain::instance().release_slot(slot);
+    }
+};
+
+static thread_local EpochThread tls_epoch;
+
+
+EpochDomain &EpochDomain::instance() {
+    static EpochDomain domain;
+    return domain;
+}
+
+int EpochDomain::claim_slot() {
+    for (size_t i = 0; i < MAX_READERS; i++) {
+        bool expected = false;
+        if (!slots_[i].taken.load(std::memory_order_relaxed) &&
+            slots_[i].taken.compare_exchange_strong(expected, true))
+            return (int)i;
+    }
+    return -1;
+}
+
+void EpochDomain::release_slot(int slot) {
+    slots_[slot].epoch.store(IDLE, std::memory_order_release);
+    slots_[slot].taken.store(false, std::memory_order_release);
+}
+
+bool EpochDomain::enter() {
+    EpochThread &t = tls_epoch;
+    if (t.slot < 0) {
+        t.slot = claim_slot();
+        if (t.slot < 0) return false;
+    }
+
+    if (t.depth++ == 0) {
+        slots_[t.slot].epoch.store(global_.load(std::memory_order_relaxed),
+                                   std::memory_order_relaxed);
+        // the announcement must be visible before any shared pointer load
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    return true;
+}
+
+void EpochDomain::exit() {
+    EpochThread &t = tls_epoch;
+    if (--t.depth == 0)
+        slots_[t.slot].epoch.store(IDLE, std::memory_order_release);
+}
+
+uint64_t EpochDomain::retire_epoch() {
+    // order the caller's unlink before reading the epoch
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return global_.load(std::memory_order_relaxed);
+}
+
+uint64_t EpochDomain::reclaim_bound() {
+    uint64_t bound = global_.fetch_add(1) + 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    for (size_t i = 0; i < MAX_READERS; i++) {
+        // acquire: whatever a reader did before leaving is visible
+        uint64_t e = slots_[i].epoch.load(std::memory_order_acquire);
+        if (e < bound) bound = e;
+    }
+    return bound;
+}
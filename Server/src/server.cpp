@@ -2,28 +2,202 @@
 #include "cache.h"
 #include "dbpool.h"
 #include "async.h"
+#include "singleflight.h"
+#include "topology.h"
+#include "writegen.h"
 
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <atomic>
 #include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <unistd.h>
+
+
+// CLOCK keeps hits free of shard writes for the read-heavy workloads;
+// admission stops get-all/put-all scans from flushing the hot keys.
+// The TTL bounds how long a row changed behind our back (another node,
+// or MySQL directly) can be served stale. The disk tier is off unless
+// --spill names a file (see main).
+static CacheOptions cache_options() {
+    CacheOptions o;
+    o.num_shards = 32;
+    o.byte_budget = 256u << 20;    // 256 MB of keys, values and overhead
+    o.policy = EvictionPolicy::CLOCK;
+    o.admission = true;
+    o.default_ttl = std::chrono::seconds(60);
+    o.expiry_interval = std::chrono::seconds(1);
+    o.hot_replicas = 4;            // spread popular keys over 4 shards
+    o.l1_entries = 256;            // per worker thread
+    o.compress_min = 512;          // gzip larger values
+    o.numa = false;                // --numa: shards on the nodes of their workers
+    return o;
+}
+
+// Keys known to be missing from MySQL, so a repeated 404 does not cost a
+// pool connection and a SELECT. Entries have empty values; create and
+// delete keep it in step with the main cache, the TTL with other nodes.
+static CacheOptions absent_options() {
+    CacheOptions o;
+    o.num_shards = 32;
+    o.byte_budget = 32u << 20;
+    o.policy = EvictionPolicy::CLOCK;
+    o.default_ttl = std::chrono::seconds(60);
+    o.expiry_interval = std::chrono::seconds(1);
+    return o;
+}
+
+// Writes reach MySQL in batches of up to 512, each given 5 ms to fill:
+// under load a transaction per few hundred puts, when idle a put is
+// written at most 5 ms late. Six writers leave two of the eight pool
+// connections to cache misses. If MySQL falls behind, at most 100k
+// writes (256 MB) wait for it; past that puts and deletes get 503 and
+// the client retries, rather than the queue growing until the box dies.
+// Each writer's ring is sized for its share, about 3 MB. A queued write
+// keeps its key's write stripe busy until it is in MySQL.
+static constexpr size_t DB_POOL_SIZE = 8;
+
+static WriteGenerations write_gens;
+
+static AsyncOptions async_options() {
+    AsyncOptions o;
+    o.max_batch = 512;
+    o.batch_window = std::chrono::milliseconds(5);
+    o.writers = DB_POOL_SIZE - 2;
+    o.max_queued = 100000;
+    o.max_queued_bytes = 256u << 20;
+    o.when_full = Backpressure::SHED;
+    o.on_commit = [](uint64_t hash) { write_gens.end(hash); };
+    return o;
+}
 
+// Cache snapshot, written at shutdown and on POST /snapshot and loaded
+// before the listener opens. Without one the most recently written rows
+// are prefetched from MySQL instead.
+static const char *SNAPSHOT_PATH = "cache.snap";
+static constexpr size_t SNAPSHOT_LOAD_THREADS = 4;
+static constexpr size_t PREFETCH_KEYS = 100000;
 
-ShardedLRUCache cache(32, 256);
+ShardedLRUCache *cache = nullptr;
+ShardedLRUCache absent(absent_options());
 MySQLPool *dbpool = nullptr;
 AsyncWriter *asyncWriter = nullptr;
+SingleFlight inflight;
+
+
+// A create or delete on its key's write stripe (writegen.h). It counts
+// in twice: once for the handler, out when it returns, and once for the
+// queued row, out when the writer reports it in MySQL.
+struct StripeWrite {
+    const CacheKey &key;
+    uint32_t held = 2;
+    explicit StripeWrite(const CacheKey &k) : key(k) { write_gens.begin(k.hash, held); }
+    ~StripeWrite() { write_gens.end(key.hash, held); }
+    void queued() { held = 1; }
+};
+
+
+// Whether the client takes a gzip body. A plain substring test: nobody
+// sends "gzip;q=0" to a key-value store.
+static bool accepts_gzip(mg_connection *conn) {
+    const char *ae = mg_get_header(conn, "Accept-Encoding");
+    return ae && std::strstr(ae, "gzip") != nullptr;
+}
 
+// The write queue to MySQL is full and the write was not taken.
+static void reply_busy(mg_connection *conn) {
+    mg_printf(conn,
+        "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n"
+        "Content-Type: text/plain\r\n\r\nbusy\n");
+}
 
-static std::string sql_escape(MYSQL *conn, const std::string &s) {
+
+static std::string sql_escape(MYSQL *conn, std::string_view s) {
     std::string out;
     out.resize(s.size() * 2 + 1);
     unsigned long n = mysql_real_escape_string(conn, &out[0],
-                                               s.c_str(), s.size());
+                                               s.data(), s.size());
     out.resize(n);
     return out;
 }
 
 
+// Read key from MySQL and fill the matching cache, unless a write to the
+// key's stripe was in progress when gen was taken or began since.
+static FlightResult load_row(const CacheKey &ck, uint64_t gen) {
+    FlightResult r;
+    MYSQL *c = dbpool->acquire();
+
+    std::string ek = sql_escape(c, ck.str);
+    std::string q = "SELECT v FROM kvstore WHERE k='" + ek + "'";
+
+    if (mysql_query(c, q.c_str())) {
+        r.error = mysql_error(c);
+        dbpool->release(c);
+        return r;
+    }
+
+    MYSQL_RES *res = mysql_store_result(c);
+
+    if (res) {
+        MYSQL_ROW row = mysql_fetch_row(res);
+        if (row) {
+            r.value = row[0] ? row[0] : "";
+            r.found = true;
+        }
+        mysql_free_result(res);
+    }
+
+    dbpool->release(c);
+    r.ok = true;
+
+    if (!WriteGenerations::fillable(gen))
+        return r;
+    if (r.found)
+        cache->cache_fill(ck, r.value, write_gens.stripe(ck.hash), gen);
+    else
+        absent.cache_fill(ck, std::string_view(), write_gens.stripe(ck.hash), gen);
+    return r;
+}
+
+
+// Fallback warm-up: kvstore keeps no access counts, so the n most
+// recently written rows stand in for the hottest. They are inserted
+// oldest first, leaving the newest most recently used.
+static size_t prefetch_hot(size_t n) {
+    MYSQL *c = dbpool->acquire();
+    std::string q = "SELECT k, v FROM kvstore ORDER BY updated DESC LIMIT "
+                  + std::to_string(n);
+
+    if (mysql_query(c, q.c_str())) {
+        std::cerr << "[Warmup] Prefetch error: " << mysql_error(c) << "\n";
+        dbpool->release(c);
+        return 0;
+    }
+
+    MYSQL_RES *res = mysql_store_result(c);
+    size_t loaded = 0;
+
+    if (res) {
+        for (uint64_t i = mysql_num_rows(res); i-- > 0;) {
+            mysql_data_seek(res, i);
+            MYSQL_ROW row = mysql_fetch_row(res);
+            if (!row || !row[0]) continue;
+            cache->cache_put(row[0], row[1] ? row[1] : "");
+            loaded++;
+        }
+        mysql_free_result(res);
+    }
+
+    dbpool->release(c);
+    return loaded;
+}
+
+
 class KVHandler : public CivetHandler {
 
 public:
@@ -39,7 +213,7 @@ bool handleGet(CivetServer *, mg_connection *conn) override {
                    "key", keybuf, sizeof(keybuf));
     }
 
-    std::string key = keybuf;
+    std::string_view key = keybuf;
 
     if (key.empty()) {
         mg_printf(conn,
@@ -48,58 +222,50 @@ bool handleGet(CivetServer *, mg_connection *conn) override {
         return true;
     }
 
-    
-    std::string value;
-    if (cache.cache_get(key, value)) {
+    // hashed once for the lookup and, on a miss, the fill
+    CacheKey ck(key);
+    uint64_t gen = write_gens.stripe(ck.hash).load(std::memory_order_acquire);
+
+    // hit: write the pinned value straight from cache memory, still
+    // compressed if it is stored that way and the client takes gzip
+    CacheHandle hit;
+    if (cache->cache_get(ck, hit, accepts_gzip(conn))) {
         mg_printf(conn,
-            "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n%s",
-            value.c_str());
+            "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n%s\r\n",
+            hit.gzipped() ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" : "");
+        mg_write(conn, hit.value().data(), hit.value().size());
         return true;
     }
 
-    
-    MYSQL *c = dbpool->acquire();
-
-    std::string ek = sql_escape(c, key);
-    std::string q = "SELECT v FROM kvstore WHERE k='" + ek + "'";
-
-    if (mysql_query(c, q.c_str())) {
-        std::string err = mysql_error(c);
-        dbpool->release(c);
-
+    // known to be absent from MySQL
+    if (absent.cache_get(ck, hit)) {
         mg_printf(conn,
-            "HTTP/1.1 500 Internal Server Error\r\n"
-            "Content-Type: text/plain\r\n\r\nDB error: %s\n", err.c_str());
+            "HTTP/1.1 404 Not Found\r\n"
+            "Content-Type: text/plain\r\n\r\nnot found\n");
         return true;
     }
 
-    MYSQL_RES *res = mysql_store_result(c);
-    bool found = false;
+    // miss: load from MySQL, once for all concurrent misses on the key
+    std::shared_ptr<const FlightResult> res =
+        inflight.run(ck, [&] { return load_row(ck, gen); });
 
-    if (res) {
-        MYSQL_ROW row = mysql_fetch_row(res);
-        if (row) {
-            value = row[0] ? row[0] : "";
-            found = true;
-        }
-        mysql_free_result(res);
+    if (!res->ok) {
+        mg_printf(conn,
+            "HTTP/1.1 500 Internal Server Error\r\n"
+            "Content-Type: text/plain\r\n\r\nDB error: %s\n", res->error.c_str());
+        return true;
     }
 
-    dbpool->release(c);
-
-    if (!found) {
+    if (!res->found) {
         mg_printf(conn,
             "HTTP/1.1 404 Not Found\r\n"
             "Content-Type: text/plain\r\n\r\nnot found\n");
         return true;
     }
 
-    // store to cache
-    cache.cache_put(key, value);
-
     mg_printf(conn,
-        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n%s",
-        value.c_str());
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n");
+    mg_write(conn, res->value.data(), res->value.size());
     return true;
 }
 
@@ -124,8 +290,8 @@ bool handlePost(CivetServer *, mg_connection *conn) override {
     mg_get_var(body.c_str(), body.size(), "key", kbuf, sizeof(kbuf));
     mg_get_var(body.c_str(), body.size(), "value", vbuf, sizeof(vbuf));
 
-    std::string key = kbuf;
-    std::string value = vbuf;
+    std::string_view key = kbuf;
+    std::string_view value = vbuf;
 
     if (key.empty()) {
         mg_printf(conn,
@@ -134,11 +300,21 @@ bool handlePost(CivetServer *, mg_connection *conn) override {
         return true;
     }
 
-    // Update cache
-    cache.cache_put(key, value);
+    // first, so no miss in flight can fill the caches behind us
+    CacheKey ck(key);
+    StripeWrite sw(ck);
 
-    // Async DB insert/update
-    asyncWriter->async_insert(key, value);
+    // Async DB insert/update, before the caches: a write MySQL cannot
+    // take now changes nothing
+    if (!asyncWriter->async_insert(std::string(key), ck.hash, std::string(value))) {
+        reply_busy(conn);
+        return true;
+    }
+    sw.queued();
+
+    // Update cache
+    cache->cache_put(ck, value);
+    absent.cache_delete(ck);
 
     mg_printf(conn,
         "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nok\n");
@@ -158,7 +334,7 @@ bool handleDelete(CivetServer *, mg_connection *conn) override {
                    "key", keybuf, sizeof(keybuf));
     }
 
-    std::string key = keybuf;
+    std::string_view key = keybuf;
 
     if (key.empty()) {
         mg_printf(conn,
@@ -167,11 +343,20 @@ bool handleDelete(CivetServer *, mg_connection *conn) override {
         return true;
     }
 
-    // remove from cache
-    cache.cache_delete(key);
+    CacheKey ck(key);
+    StripeWrite sw(ck);
 
     // async delete from db
-    asyncWriter->async_delete(key);
+    if (!asyncWriter->async_delete(std::string(key), ck.hash)) {
+        reply_busy(conn);
+        return true;
+    }
+    sw.queued();
+
+    // remove from cache; the row is gone as far as readers are concerned,
+    // even before the async delete reaches MySQL
+    cache->cache_delete(ck);
+    absent.cache_put(ck, std::string_view());
 
     mg_printf(conn,
         "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\ndeleted\n");
@@ -181,9 +366,220 @@ bool handleDelete(CivetServer *, mg_connection *conn) override {
 }; 
 
 
+// Counters as JSON: GET /stats. Cheap enough to poll; only the memory
+// figures take each shard lock, briefly.
+class StatsHandler : public CivetHandler {
+
+public:
+
+bool handleGet(CivetServer *, mg_connection *conn) override {
+    std::ostringstream out;
+
+    out << "{\"cache\":";
+    write_totals(out, cache->cache_stats());
+    out << ",\"absent\":";
+    write_totals(out, absent.cache_stats());
+    out << ",\"coalesced\":" << inflight.coalesced();
+    AsyncStats as = asyncWriter->stats();
+    out << ",\"writes\":{\"queued\":" << as.queued
+        << ",\"queued_bytes\":" << as.queued_bytes
+        << ",\"oldest_ms\":" << as.oldest_ms
+        << ",\"coalesced\":" << as.coalesced << ",\"blocked\":" << as.blocked
+        << ",\"shed\":" << as.shed << ",\"synced\":" << as.synced << "}";
+    out << ",\"resizing\":" << (cache->cache_resizing() ? "true" : "false");
+
+    out << ",\"shards\":[";
+    std::vector<ShardStats> shards = cache->cache_shard_stats();
+    for (size_t i = 0; i < shards.size(); i++) {
+        const ShardStats &s = shards[i];
+        out << (i ? "," : "")
+            << "{\"hits\":" << s.hits << ",\"misses\":" << s.misses
+            << ",\"inserts\":" << s.inserts << ",\"updates\":" << s.updates
+            << ",\"evictions\":" << s.evictions << ",\"expired\":" << s.expired
+            << ",\"lock_waits\":" << s.lock_waits
+            << ",\"entries\":" << s.entries << ",\"bytes\":" << s.bytes
+            << ",\"node\":" << s.node << ",\"remote\":" << s.remote
+            << ",\"accesses\":" << s.accesses << "}";
+    }
+    out << "]}\n";
+
+    std::string body = out.str();
+    mg_printf(conn,
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n");
+    mg_write(conn, body.data(), body.size());
+    return true;
+}
+
+private:
+
+static void write_totals(std::ostringstream &out, const CacheStats &st) {
+    out << "{\"hits\":" << st.hits << ",\"misses\":" << st.misses
+        << ",\"hit_ratio\":" << st.hit_ratio()
+        << ",\"inserts\":" << st.inserts << ",\"updates\":" << st.updates
+        << ",\"evictions\":" << st.evictions << ",\"expired\":" << st.expired
+        << ",\"admitted\":" << st.admitted << ",\"rejected\":" << st.rejected
+        << ",\"lock_waits\":" << st.lock_waits
+        << ",\"replica_hits\":" << st.replica_hits << ",\"l1_hits\":" << st.l1_hits
+        << ",\"spilled\":" << st.spilled << ",\"spill_hits\":" << st.spill_hits
+        << ",\"entries\":" << st.entries << ",\"bytes\":" << st.bytes
+        << ",\"mem_reserved\":" << st.mem_reserved << ",\"mem_used\":" << st.mem_used
+        << ",\"fragmentation\":" << st.fragmentation()
+        << ",\"remote_ratio\":" << st.remote_ratio() << "}";
+}
+
+};
+
+
+// On-demand snapshot: POST /snapshot
+class SnapshotHandler : public CivetHandler {
+
+public:
+
+bool handlePost(CivetServer *, mg_connection *conn) override {
+    if (!cache->cache_dump(SNAPSHOT_PATH)) {
+        mg_printf(conn,
+            "HTTP/1.1 500 Internal Server Error\r\n"
+            "Content-Type: text/plain\r\n\r\nsnapshot failed\n");
+        return true;
+    }
+
+    mg_printf(conn,
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nok\n");
+    return true;
+}
+
+};
+
+
+// A decimal count; an empty string is 0.
+static bool parse_size(const char *s, size_t *out) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (*end || *s == '-') return false;
+    *out = (size_t)v;
+    return true;
+}
+
+
+// Re-partition the cache without a restart: POST /admin/resize with
+// shards=N and/or budget_mb=M (either may be left out to keep it). The
+// entries move over in the background; GET /stats shows when it is done.
+// Served only on the admin listener, which is bound to localhost. The
+// budget may grow to 4x the configured one, and never past physical
+// memory.
+class ResizeHandler : public CivetHandler {
+
+public:
 
+bool handlePost(CivetServer *, mg_connection *conn) override {
+    const mg_request_info *ri = mg_get_request_info(conn);
 
-int main() {
+    long long len = ri->content_length;
+    std::string body;
+
+    if (len > 0) {
+        body.resize(len);
+        mg_read(conn, &body[0], len);
+    }
+
+    // an empty field is 0, i.e. unchanged
+    char sbuf[32] = {0};
+    char bbuf[32] = {0};
+
+    mg_get_var(body.c_str(), body.size(), "shards", sbuf, sizeof(sbuf));
+    mg_get_var(body.c_str(), body.size(), "budget_mb", bbuf, sizeof(bbuf));
+
+    size_t shards = 0, budget_mb = 0;
+    if ((!sbuf[0] && !bbuf[0]) || !parse_size(sbuf, &shards) || !parse_size(bbuf, &budget_mb) ||
+        shards > MAX_SHARDS || budget_mb > max_budget_mb()) {
+        mg_printf(conn,
+            "HTTP/1.1 400 Bad Request\r\n"
+            "Content-Type: text/plain\r\n\r\n"
+            "expected shards <= %zu and/or budget_mb <= %zu\n",
+            MAX_SHARDS, max_budget_mb());
+        return true;
+    }
+
+    if (!cache->cache_resize(shards, budget_mb << 20)) {
+        mg_printf(conn,
+            "HTTP/1.1 409 Conflict\r\n"
+            "Content-Type: text/plain\r\n\r\nresize already running\n");
+        return true;
+    }
+
+    mg_printf(conn,
+        "HTTP/1.1 202 Accepted\r\nContent-Type: text/plain\r\n\r\nresizing\n");
+    return true;
+}
+
+private:
+
+static constexpr size_t MAX_SHARDS = 4096;
+static constexpr size_t MAX_BUDGET_GROWTH = 4;
+
+static size_t max_budget_mb() {
+    size_t mb = MAX_BUDGET_GROWTH * (cache_options().byte_budget >> 20);
+    long pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGE_SIZE);
+    if (pages > 0 && page > 0)
+        mb = std::min<size_t>(mb, ((uint64_t)pages * (uint64_t)page) >> 20);
+    return mb;
+}
+
+};
+
+
+
+
+// With --numa, workers are spread over the NUMA nodes in turn and pinned
+// there, so the shards of each node have local threads using them.
+// Nothing happens on a single node, e.g. under `make run`.
+static bool pin_workers = false;
+
+static void *pin_worker(const mg_context *, int thread_type) {
+    static std::atomic<size_t> next{0};
+    const std::vector<int> &nodes = kv_numa_nodes();
+    if (thread_type == 1 && pin_workers && !nodes.empty())
+        kv_pin_to_node(nodes[next.fetch_add(1) % nodes.size()]);
+    return nullptr;
+}
+
+static const char *USAGE =
+    "usage: myserver [--spill PATH] [--spill-mb N] [--numa]\n"
+    "  --spill PATH    keep entries evicted from memory in a file at PATH\n"
+    "  --spill-mb N    size of that file in MB (default 1024)\n"
+    "  --numa          place shards and pin workers on NUMA nodes\n";
+
+int main(int argc, char **argv) {
+
+    CacheOptions copts = cache_options();
+    size_t spill_mb = 1024;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--spill" && i + 1 < argc && argv[i + 1][0]) {
+            copts.spill_path = argv[++i];
+        } else if (arg == "--spill-mb" && i + 1 < argc &&
+                   parse_size(argv[i + 1], &spill_mb) && spill_mb > 0 &&
+                   spill_mb <= (SIZE_MAX >> 20)) {
+            i++;
+        } else if (arg == "--numa") {
+            copts.numa = true;
+        } else {
+            std::cerr << USAGE;
+            return 2;
+        }
+    }
+    if (!copts.spill_path.empty())
+        copts.spill_bytes = spill_mb << 20;
+    pin_workers = copts.numa;
+
+    // the spill file is created here; without it, stop rather than run
+    // with less cache than asked for
+    cache = new ShardedLRUCache(copts);
+    if (copts.spill_bytes && !cache->cache_spilling()) {
+        std::cerr << "Fatal: cannot use " << copts.spill_path << " for the disk tier\n";
+        delete cache;
+        return 1;
+    }
 
     try {
         dbpool = new MySQLPool(
@@ -192,10 +588,10 @@ int main() {
             "Ayan@2003",
             "kvdb",
             3306,
-            8
+            DB_POOL_SIZE
         );
 
-        asyncWriter = new AsyncWriter(dbpool);
+        asyncWriter = new AsyncWriter(dbpool, async_options());
         asyncWriter->start();
     }
     catch (const std::exception &e) {
@@ -203,25 +599,72 @@ int main() {
         return 1;
     }
 
+    // warm the cache before taking requests
+    if (cache->cache_load(SNAPSHOT_PATH, SNAPSHOT_LOAD_THREADS))
+        std::cout << "Loaded " << cache->cache_size() << " keys from " << SNAPSHOT_PATH << "\n";
+    else
+        std::cout << "Prefetched " << prefetch_hot(PREFETCH_KEYS) << " keys from MySQL\n";
+
     const char *opts[] = {
         "listening_ports", "8080",
         nullptr
     };
 
-    CivetServer server(opts);
+    // operator endpoints get a listener of their own, reachable only
+    // from the box itself
+    const char *admin_opts[] = {
+        "listening_ports", "127.0.0.1:8081",
+        "num_threads", "2",
+        nullptr
+    };
+
+    CivetCallbacks callbacks;
+    callbacks.init_thread = pin_worker;
+    CivetServer server(opts, &callbacks);
+    CivetServer admin(admin_opts);
 
     KVHandler handler;
+    SnapshotHandler snapshot;
+    StatsHandler stats;
+    ResizeHandler resize;
 
     server.addHandler("/create", handler);
     server.addHandler("/get", handler);
     server.addHandler("/delete", handler);
+    server.addHandler("/snapshot", snapshot);
+    server.addHandler("/stats", stats);
+    admin.addHandler("/admin/resize", resize);
 
-    std::cout << "KV Server running on port 8080\n";
+    std::cout << "KV Server running on port 8080 (admin on 127.0.0.1:8081)\n";
     getchar();
+    server.close();   // no handler runs past here
+    admin.close();
+
+    CacheStats st = cache->cache_stats();
+    std::cout << "Cache: " << st.hits << " hits, " << st.misses << " misses ("
+              << st.hit_ratio() * 100 << "%), " << st.admitted << " admitted, "
+              << st.rejected << " rejected, " << st.evictions << " evicted, "
+              << st.expired << " expired, " << st.lock_waits << " lock waits, "
+              << st.replica_hits << " served by hot-key copies, "
+              << st.l1_hits << " by thread L1, " << st.spill_hits << " from the "
+              << st.spilled << " entries spilled to disk\n";
+
+    CacheStats ab = absent.cache_stats();
+    std::cout << "Absent keys: " << ab.hits << " hits, " << ab.misses << " misses ("
+              << ab.hit_ratio() * 100 << "%)\n";
+    std::cout << "Coalesced misses: " << inflight.coalesced() << "\n";
+    AsyncStats as = asyncWriter->stats();
+    std::cout << "Writes: " << as.coalesced << " coalesced, " << as.shed << " shed, "
+              << as.blocked << " blocked, " << as.synced << " written synchronously, "
+              << as.queued << " still queued\n";
+
+    if (!cache->cache_dump(SNAPSHOT_PATH))
+        std::cerr << "Cache snapshot to " << SNAPSHOT_PATH << " failed\n";
 
     asyncWriter->stop();
     delete asyncWriter;
     delete dbpool;
+    delete cache;
 
     return 0;
 }
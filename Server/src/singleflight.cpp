@@ -0,0 +1,50 @@
+#include "singleflight.h"
+#include <exception>
+
+std::shared_ptr<const FlightResult> SingleFlight::run(const CacheKey &key,
+                                                      const Loader &load) {
+    Stripe &st = stripes_[key.hash & (STRIPES - 1)];
+    std::shared_ptr<Call> call;
+    bool leader = false;
+
+    {
+        std::lock_guard<std::mutex> lk(st.mtx);
+        auto it = st.calls.find(std::string(key.str));
+        if (it != st.calls.end()) {
+            call = it->second;
+        } else {
+            call = std::make_shared<Call>();
+            st.calls.emplace(std::string(key.str), call);
+            leader = true;
+        }
+    }
+
+    if (!leader) {
+        coalesced_.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lk(call->mtx);
+        call->cv.wait(lk, [&] { return call->done; });
+        return std::shared_ptr<const FlightResult>(call, &call->result);
+    }
+
+    FlightResult r;
+    try {
+        r = load();
+    } catch (const std::exception &e) {
+        r.ok = false;
+        r.error = e.what();
+    }
+
+    // unpublish first: a miss from here on starts a fresh load
+    {
+        std::lock_guard<std::mutex> lk(st.mtx);
+        st.calls.erase(std::string(key.str));
+    }
+    {
+        std::lock_guard<std::mutex> lk(call->mtx);
+        call->result = std::move(r);
+        call->done = true;
+    }
+    call->cv.notify_all();
+
+    return std::shared_ptr<const FlightResult>(call, &call->result);
+}
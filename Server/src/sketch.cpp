@@ -0,0 +1,71 @@
+#include "sketch.h"
+#include "topology.h"
+#include <new>
+
+static const uint64_t ROW_SEEDS[] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+    0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+};
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+
+FrequencySketch::FrequencySketch(size_t capacity, int node) : node_(node) {
+    width_ = 16;
+    while (width_ < capacity) width_ <<= 1;
+    sample_size_ = (capacity ? capacity : 1) * 10;
+
+    void *mem = kv_node_alloc(DEPTH * width_, node_);
+    counters_ = static_cast<std::atomic<uint8_t> *>(mem);
+    for (size_t i = 0; i < DEPTH * width_; i++)
+        new (&counters_[i]) std::atomic<uint8_t>(0);
+}
+
+FrequencySketch::~FrequencySketch() {
+    kv_node_free(counters_, DEPTH * width_, node_);
+}
+
+size_t FrequencySketch::index(uint64_t h, int row) const {
+    return row * width_ + (mix64(h + ROW_SEEDS[row]) & (width_ - 1));
+}
+
+void FrequencySketch::increment(uint64_t h) {
+    bool added = false;
+    for (int r = 0; r < DEPTH; r++) {
+        std::atomic<uint8_t> &c = counters_[index(h, r)];
+        uint8_t v = c.load(std::memory_order_relaxed);
+        if (v < MAX_COUNT) {
+            c.store(v + 1, std::memory_order_relaxed);
+            added = true;
+        }
+    }
+
+    if (added &&
+        additions_.fetch_add(1, std::memory_order_relaxed) + 1 == sample_size_)
+        age();
+}
+
+uint32_t FrequencySketch::frequency(uint64_t h) const {
+    uint32_t f = MAX_COUNT;
+    for (int r = 0; r < DEPTH; r++) {
+        uint8_t v = counters_[index(h, r)].load(std::memory_order_relaxed);
+        if (v < f) f = v;
+    }
+    return f;
+}
+
+// Only the thread whose increment reached sample_size_ gets here.
+void FrequencySketch::age() {
+    for (size_t i = 0; i < DEPTH * width_; i++) {
+        uint8_t v = counters_[i].load(std::memory_order_relaxed);
+        counters_[i].store(v >> 1, std::memory_order_relaxed);
+    }
+    additions_.store(sample_size_ / 2, std::memory_order_relaxed);
+}
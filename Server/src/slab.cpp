@@ -0,0 +1,228 @@
+#include "slab.h"
+#include "topology.h"
+#include <sys/mman.h>
+#include <cstdlib>
+#include <new>
+
+static constexpr size_t MIN_CHUNK = 32;
+static constexpr size_t MAX_CHUNK = SlabAllocator::PAGE_SIZE / 4;
+static constexpr size_t CHUNK_ALIGN = 8;
+
+// Chunks start after the page header, on a cache-line boundary.
+static constexpr size_t PAGE_HEADER = 64;
+
+// Empty pages kept for reuse before they are handed back to the OS.
+static constexpr size_t POOL_MAX_PAGES = 8;
+
+// Node-local pages come in extents of this many; a mapping of their own
+// each would cost the kernel a mapping per 32 KB.
+static constexpr size_t EXTENT_PAGES = 64;
+static constexpr size_t EXTENT_BYTES = (EXTENT_PAGES + 1) * SlabAllocator::PAGE_SIZE;  // + alignment
+
+// Size class table shared by every allocator: class sizes plus a lookup
+// from (request / CHUNK_ALIGN) to class index.
+struct SlabClasses {
+    std::vector<uint32_t> sizes;
+    std::vector<uint8_t> lookup;
+
+    SlabClasses() {
+        size_t sz = MIN_CHUNK;
+        for (;;) {
+            sizes.push_back((uint32_t)sz);
+            if (sz >= MAX_CHUNK) break;
+            size_t next = (sz * 5 / 4 + CHUNK_ALIGN - 1) & ~(CHUNK_ALIGN - 1);
+            sz = next < MAX_CHUNK ? next : MAX_CHUNK;
+        }
+
+        lookup.resize(MAX_CHUNK / CHUNK_ALIGN + 1);
+        size_t c = 0;
+        for (size_t i = 0; i < lookup.size(); i++) {
+            while (sizes[c] < i * CHUNK_ALIGN) c++;
+            lookup[i] = (uint8_t)c;
+        }
+    }
+
+    uint32_t class_of(size_t n) const {
+        return lookup[(n + CHUNK_ALIGN - 1) / CHUNK_ALIGN];
+    }
+
+    uint32_t per_page(uint32_t cls) const {
+        return (uint32_t)((SlabAllocator::PAGE_SIZE - PAGE_HEADER) / sizes[cls]);
+    }
+};
+
+static const SlabClasses &slab_classes() {
+    static const SlabClasses classes;
+    return classes;
+}
+
+
+void SlabAllocator::PageList::push(Page *p) {
+    p->prev = nullptr;
+    p->next = head;
+    if (head) head->prev = p;
+    head = p;
+}
+
+void SlabAllocator::PageList::remove(Page *p) {
+    if (p->prev) p->prev->next = p->next;
+    else head = p->next;
+    if (p->next) p->next->prev = p->prev;
+    p->prev = p->next = nullptr;
+}
+
+
+SlabAllocator::SlabAllocator(int node)
+    : node_(node), classes_(slab_classes().sizes.size()) {}
+
+// Node pages go with their extents.
+SlabAllocator::~SlabAllocator() {
+    if (node_ >= 0) {
+        for (char *e : extents_)
+            kv_node_free(e, EXTENT_BYTES, node_);
+        return;
+    }
+
+    auto free_list = [](PageList &l) {
+        while (Page *p = l.head) {
+            l.remove(p);
+            std::free(p);
+        }
+    };
+    for (SizeClass &sc : classes_) {
+        free_list(sc.partial);
+        free_list(sc.full);
+    }
+    free_list(pool_);
+}
+
+size_t SlabAllocator::chunk_size(size_t n) {
+    if (n > MAX_CHUNK) return n;
+    const SlabClasses &sc = slab_classes();
+    return sc.sizes[sc.class_of(n)];
+}
+
+SlabAllocator::Page *SlabAllocator::take_page(uint32_t cls) {
+    Page *p = pool_.head;
+    if (p) {
+        pool_.remove(p);
+        pool_pages_--;
+    } else if (node_ >= 0) {
+        p = node_page();
+    } else {
+        p = static_cast<Page *>(std::aligned_alloc(PAGE_SIZE, PAGE_SIZE));
+        if (!p) throw std::bad_alloc();
+        stats_.reserved += PAGE_SIZE;
+    }
+
+    p->free_list = nullptr;
+    p->cls = cls;
+    p->used = 0;
+    p->carved = 0;
+    return p;
+}
+
+// An idle page is reused before a new one is carved; its memory comes
+// back zeroed, from the node, on first touch.
+SlabAllocator::Page *SlabAllocator::node_page() {
+    stats_.reserved += PAGE_SIZE;
+    if (!idle_.empty()) {
+        Page *p = idle_.back();
+        idle_.pop_back();
+        return p;
+    }
+
+    if (extent_left_ == 0) {
+        char *e = static_cast<char *>(kv_node_alloc(EXTENT_BYTES, node_));
+        extents_.push_back(e);
+        extent_next_ = reinterpret_cast<char *>(
+            (reinterpret_cast<uintptr_t>(e) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+        extent_left_ = (size_t)(e + EXTENT_BYTES - extent_next_) / PAGE_SIZE;
+    }
+    Page *p = reinterpret_cast<Page *>(extent_next_);
+    extent_next_ += PAGE_SIZE;
+    extent_left_--;
+    return p;
+}
+
+void SlabAllocator::give_page(Page *p) {
+    if (pool_pages_ >= POOL_MAX_PAGES) {
+        if (node_ >= 0) {
+            madvise(p, PAGE_SIZE, MADV_DONTNEED);
+            idle_.push_back(p);
+        } else {
+            std::free(p);
+        }
+        stats_.reserved -= PAGE_SIZE;
+        return;
+    }
+    pool_.push(p);
+    pool_pages_++;
+}
+
+void *SlabAllocator::allocate(size_t n) {
+    stats_.requested += n;
+    if (n > MAX_CHUNK) {
+        stats_.reserved += n;
+        stats_.used += n;
+        return node_ >= 0 ? kv_node_alloc(n, node_) : ::operator new(n);
+    }
+
+    const SlabClasses &tab = slab_classes();
+    uint32_t cls = tab.class_of(n);
+    uint32_t size = tab.sizes[cls];
+    uint32_t per_page = tab.per_page(cls);
+    SizeClass &sc = classes_[cls];
+
+    Page *p = sc.partial.head;
+    if (!p) {
+        p = take_page(cls);
+        sc.partial.push(p);
+    }
+
+    void *chunk;
+    if (p->free_list) {
+        chunk = p->free_list;
+        p->free_list = *static_cast<void **>(chunk);
+    } else {
+        chunk = reinterpret_cast<char *>(p) + PAGE_HEADER + (size_t)p->carved * size;
+        p->carved++;
+    }
+
+    if (++p->used == per_page) {
+        sc.partial.remove(p);
+        sc.full.push(p);
+    }
+
+    stats_.used += size;
+    return chunk;
+}
+
+void SlabAllocator::deallocate(void *ptr, size_t n) {
+    stats_.requested -= n;
+    if (n > MAX_CHUNK) {
+        stats_.reserved -= n;
+        stats_.used -= n;
+        if (node_ >= 0) kv_node_free(ptr, n, node_);
+        else ::operator delete(ptr);
+        return;
+    }
+
+    const SlabClasses &tab = slab_classes();
+    Page *p = reinterpret_cast<Page *>(reinterpret_cast<uintptr_t>(ptr) & ~(PAGE_SIZE - 1));
+    SizeClass &sc = classes_[p->cls];
+    stats_.used -= tab.sizes[p->cls];
+
+    if (p->used == tab.per_page(p->cls)) {
+        sc.full.remove(p);
+        sc.partial.push(p);
+    }
+
+    *static_cast<void **>(ptr) = p->free_list;
+    p->free_list = ptr;
+
+    if (--p->used == 0) {
+        sc.partial.remove(p);
+        give_page(p);
+    }
+}
@@ -0,0 +1,167 @@
+#include "spill.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Segments are recycled whole; a record never spans two of them.
+static constexpr size_t SEGMENT_BYTES = 16u << 20;
+static constexpr size_t MAX_SEGMENTS = 1u << 16;   // segment field of a location
+
+static inline size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+
+SpillCache::SpillCache(const std::string &path, size_t bytes) {
+    // small files still get two segments, so one can be recycled while
+    // the other holds the most recent records
+    seg_bytes_ = bytes >= 2 * SEGMENT_BYTES ? SEGMENT_BYTES : (bytes / 2) & ~(size_t)7;
+    if (seg_bytes_ < sizeof(Record)) return;
+    num_segs_ = (uint32_t)std::min(bytes / seg_bytes_, MAX_SEGMENTS);
+    size_t total = (size_t)num_segs_ * seg_bytes_;
+
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        std::cerr << "[Spill] open " << path << ": " << std::strerror(errno) << "\n";
+        return;
+    }
+    if (ftruncate(fd_, (off_t)total) != 0) {
+        std::cerr << "[Spill] resize " << path << ": " << std::strerror(errno) << "\n";
+        return;
+    }
+
+    void *p = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) {
+        std::cerr << "[Spill] mmap " << path << ": " << std::strerror(errno) << "\n";
+        return;
+    }
+    // reads are point lookups; readahead would only waste page cache
+    madvise(p, total, MADV_RANDOM);
+
+    segs_.reset(new Segment[num_segs_]);
+    bytes_ = total;
+    base_ = static_cast<char *>(p);
+}
+
+SpillCache::~SpillCache() {
+    if (base_) munmap(base_, bytes_);
+    if (fd_ >= 0) close(fd_);
+}
+
+
+// Drop the index entries still pointing into segment s and start it
+// over. Called with write_mtx_ held.
+void SpillCache::recycle(uint32_t s) {
+    Segment &seg = segs_[s];
+    std::unique_lock<std::shared_mutex> lk(seg.mtx);
+    const char *p = base_ + (size_t)s * seg_bytes_;
+
+    for (uint32_t off = 0; off < seg.used;) {
+        Record r;
+        std::memcpy(&r, p + off, sizeof(r));
+
+        Stripe &st = stripe(r.hash);
+        {
+            std::lock_guard<std::mutex> sl(st.mtx);
+            auto it = st.index.find(r.hash);
+            if (it != st.index.end() && it->second == pack(s, seg.gen, off))
+                st.index.erase(it);
+        }
+        off += (uint32_t)align8(sizeof(r) + r.klen + r.vlen);
+    }
+
+    seg.used = 0;
+    seg.gen++;
+}
+
+void SpillCache::put(std::string_view key, uint64_t hash, std::string_view value,
+                     uint32_t raw_len, uint64_t expires, uint64_t version) {
+    size_t len = align8(sizeof(Record) + key.size() + value.size());
+    if (!base_ || len > seg_bytes_ || !stable(version) || this->version(hash) != version)
+        return;
+
+    std::lock_guard<std::mutex> wl(write_mtx_);
+    if (segs_[head_].used + len > seg_bytes_) {
+        head_ = (head_ + 1) % num_segs_;
+        recycle(head_);
+    }
+
+    Segment &seg = segs_[head_];
+    uint32_t off = seg.used;
+    char *p = base_ + (size_t)head_ * seg_bytes_ + off;
+
+    Record r{hash, expires, (uint32_t)key.size(), (uint32_t)value.size(), raw_len, 0};
+    std::memcpy(p, &r, sizeof(r));
+    std::memcpy(p + sizeof(r), key.data(), key.size());
+    std::memcpy(p + sizeof(r) + key.size(), value.data(), value.size());
+    seg.used += (uint32_t)len;
+
+    // a write to the key since the version was taken leaves the record
+    // unreachable; its space comes back when the segment is recycled
+    Stripe &st = stripe(hash);
+    std::lock_guard<std::mutex> sl(st.mtx);
+    if (st.version.load(std::memory_order_relaxed) != version)
+        return;
+    st.index[hash] = pack(head_, seg.gen, off);
+    written_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool SpillCache::get(std::string_view key, uint64_t hash, uint64_t now_ms,
+                     std::string &value, uint32_t *raw_len, uint64_t *expires) {
+    if (!base_) return false;
+
+    uint64_t loc;
+    {
+        Stripe &st = stripe(hash);
+        std::lock_guard<std::mutex> sl(st.mtx);
+        auto it = st.index.find(hash);
+        if (it == st.index.end())
+            return false;
+        loc = it->second;
+    }
+
+    uint32_t s = (uint32_t)(loc >> 48);
+    uint16_t gen = (uint16_t)(loc >> 32);
+    uint32_t off = (uint32_t)loc;
+
+    // the segment may have been recycled since the index was read
+    Segment &seg = segs_[s];
+    std::shared_lock<std::shared_mutex> lk(seg.mtx);
+    if (seg.gen != gen)
+        return false;
+
+    const char *p = base_ + (size_t)s * seg_bytes_ + off;
+    Record r;
+    std::memcpy(&r, p, sizeof(r));
+    if (r.hash != hash || r.klen != key.size() ||
+        std::memcmp(p + sizeof(r), key.data(), key.size()) != 0 ||
+        (r.expires && r.expires <= now_ms))
+        return false;
+
+    value.assign(p + sizeof(r) + r.klen, r.vlen);
+    *raw_len = r.raw_len;
+    *expires = r.expires;
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+
+void SpillCache::begin_write(uint64_t hash) {
+    Stripe &st = stripe(hash);
+    std::lock_guard<std::mutex> sl(st.mtx);
+    st.version.fetch_add(BUMP + WRITER, std::memory_order_acq_rel);
+    st.index.erase(hash);
+}
+
+void SpillCache::end_write(uint64_t hash) {
+    Stripe &st = stripe(hash);
+    std::lock_guard<std::mutex> sl(st.mtx);
+    st.version.fetch_add(BUMP - WRITER, std::memory_order_acq_rel);
+    st.index.erase(hash);
+}
+
+uint64_t SpillCache::version(uint64_t hash) const {
+    return stripe(hash).version.load(std::memory_order_acquire);
+}
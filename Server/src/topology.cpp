@@ -0,0 +1,87 @@
+#include "topology.h"
+#include <new>
+
+#ifdef HAVE_NUMA
+
+#include <numa.h>
+#include <sched.h>
+
+// libnuma must not be used before numa_available() says it works.
+static std::vector<int> find_nodes() {
+    std::vector<int> nodes;
+    if (numa_available() < 0)
+        return nodes;
+
+    struct bitmask *run = numa_get_run_node_mask();
+    for (int n = 0; n <= numa_max_node(); n++)
+        if (numa_bitmask_isbitset(run, n))
+            nodes.push_back(n);
+    numa_bitmask_free(run);
+
+    if (nodes.size() < 2)
+        nodes.clear();
+    return nodes;
+}
+
+const std::vector<int> &kv_numa_nodes() {
+    static const std::vector<int> nodes = find_nodes();
+    return nodes;
+}
+
+static thread_local int tls_node = -2;     // -2: not looked up yet
+
+int kv_this_node() {
+    if (tls_node == -2) {
+        int cpu = kv_numa_nodes().empty() ? -1 : sched_getcpu();
+        tls_node = cpu < 0 ? -1 : numa_node_of_cpu(cpu);
+    }
+    return tls_node;
+}
+
+bool kv_pin_to_node(int node) {
+    if (kv_numa_nodes().empty() || numa_run_on_node(node) != 0)
+        return false;
+    tls_node = node;
+    return true;
+}
+
+void *kv_node_alloc(size_t bytes, int node) {
+    if (node < 0)
+        return ::operator new(bytes, std::align_val_t(64));
+
+    void *p = numa_alloc_onnode(bytes, node);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void kv_node_free(void *p, size_t bytes, int node) {
+    if (node < 0)
+        ::operator delete(p, std::align_val_t(64));
+    else
+        numa_free(p, bytes);
+}
+
+#else // !HAVE_NUMA: built without libnuma, everything is on one node
+
+const std::vector<int> &kv_numa_nodes() {
+    static const std::vector<int> none;
+    return none;
+}
+
+int kv_this_node() {
+    return -1;
+}
+
+bool kv_pin_to_node(int) {
+    return false;
+}
+
+void *kv_node_alloc(size_t bytes, int) {
+    return ::operator new(bytes, std::align_val_t(64));
+}
+
+void kv_node_free(void *p, size_t, int) {
+    ::operator delete(p, std::align_val_t(64));
+}
+
+#endif // HAVE_NUMA
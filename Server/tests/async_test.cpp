@@ -0,0 +1,126 @@
+// Backpressure when MySQL stops taking writes.
+//
+//   make test
+//
+// The writer is stalled inside its first batch, so nothing leaves the
+// ring. Under SHED, with no bound on queued writes, a full ring must
+// refuse the write at once (the handler answers 503) rather than leave
+// a CivetWeb worker waiting for a slot; under BLOCK the caller waits
+// until the writer drains the ring.
+
+#include "async.h"
+#include "hash.h"
+#include "fake_mysql.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <string>
+#include <thread>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        std::printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t SLOTS = 16;
+static constexpr auto PROMPT = std::chrono::milliseconds(100);
+
+static AsyncOptions options(Backpressure when_full) {
+    AsyncOptions o;
+    o.writers = 1;
+    o.max_batch = 1;
+    o.batch_window = std::chrono::milliseconds(0);
+    o.queue_slots = SLOTS;
+    o.max_queued = 0;
+    o.when_full = when_full;
+    return o;
+}
+
+static bool insert(AsyncWriter &w, size_t i) {
+    std::string k = "k" + std::to_string(i);
+    return w.async_insert(k, kv_hash(k), "v");
+}
+
+// Leave the writer stuck in MySQL with its first write.
+static void stall_writer(AsyncWriter &w) {
+    fake_mysql_stall(true);
+    insert(w, 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+}
+
+static void shed_is_prompt(MySQLPool &pool) {
+    AsyncWriter w(&pool, options(Backpressure::SHED));
+    w.start();
+    stall_writer(w);
+
+    // fill the ring, then one more; run it apart, so a caller that
+    // blocks fails the test instead of hanging it
+    std::atomic<size_t> accepted{0};
+    std::atomic<bool> refused{false};
+    Clock::duration slowest{};
+    auto producer = std::async(std::launch::async, [&] {
+        for (size_t i = 1; i <= 4 * SLOTS && !refused; i++) {
+            auto t0 = Clock::now();
+            if (insert(w, i))
+                accepted++;
+            else
+                refused = true;
+            slowest = std::max(slowest, Clock::now() - t0);
+        }
+    });
+
+    bool done = producer.wait_for(std::chrono::seconds(2)) == std::future_status::ready;
+    CHECK(done);
+    fake_mysql_stall(false);
+    producer.wait();
+
+    CHECK(refused);
+    CHECK(accepted <= SLOTS);
+    CHECK(slowest < PROMPT);
+    CHECK(w.stats().shed == 1);
+    CHECK(w.stats().blocked == 0);
+    w.stop();
+}
+
+static void block_waits(MySQLPool &pool) {
+    AsyncWriter w(&pool, options(Backpressure::BLOCK));
+    w.start();
+    stall_writer(w);
+
+    std::atomic<size_t> accepted{0};
+    auto producer = std::async(std::launch::async, [&] {
+        for (size_t i = 1; i <= 2 * SLOTS; i++)
+            if (insert(w, i))
+                accepted++;
+    });
+
+    // stuck on the full ring until MySQL moves again
+    CHECK(producer.wait_for(std::chrono::milliseconds(200)) == std::future_status::timeout);
+    CHECK(accepted <= SLOTS);
+    fake_mysql_stall(false);
+    producer.wait();
+
+    CHECK(accepted == 2 * SLOTS);
+    CHECK(w.stats().blocked > 0);
+    CHECK(w.stats().shed == 0);
+    w.stop();
+}
+
+int main() {
+    MySQLPool pool("localhost", "test", "test", "test", 3306, 2);
+
+    shed_is_prompt(pool);
+    block_waits(pool);
+
+    std::printf(failures ? "async_test: FAILED\n" : "async_test: ok\n");
+    return failures ? 1 : 0;
+}
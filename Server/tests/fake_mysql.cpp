@@ -0,0 +1,174 @@
+#include "fake_mysql.h"
+
+#include <mysql/mysql.h>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+
+namespace {
+
+struct Row {
+    bool erase;
+    std::string key;
+    std::string value;
+};
+
+// MYSQL is opaque here; the handle points at one of these.
+struct FakeConn {
+    bool in_tx = false;
+    std::vector<Row> rows;         // the open transaction's
+    std::string err;
+};
+
+std::mutex mu;
+std::condition_variable unstalled;
+bool stalled = false;
+std::map<std::string, std::string> table;
+
+FakeConn *conn_of(MYSQL *m) { return reinterpret_cast<FakeConn *>(m); }
+
+void apply(const Row &r) {
+    if (r.erase)
+        table.erase(r.key);
+    else
+        table[r.key] = r.value;
+}
+
+// The quoted literals of q, in order, unescaped.
+std::vector<std::string> literals(const std::string &q) {
+    std::vector<std::string> out;
+    for (size_t i = 0; i < q.size(); i++) {
+        if (q[i] != '\'')
+            continue;
+        std::string s;
+        for (i++; i < q.size() && q[i] != '\''; i++) {
+            if (q[i] == '\\' && i + 1 < q.size())
+                i++;
+            s += q[i];
+        }
+        out.push_back(s);
+    }
+    return out;
+}
+
+bool starts(const std::string &q, const char *prefix) {
+    return q.compare(0, std::strlen(prefix), prefix) == 0;
+}
+
+} // namespace
+
+void fake_mysql_stall(bool on) {
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        stalled = on;
+    }
+    unstalled.notify_all();
+}
+
+void fake_mysql_put(const std::string &key, const std::string &value) {
+    std::lock_guard<std::mutex> lk(mu);
+    table[key] = value;
+}
+
+bool fake_mysql_get(const std::string &key, std::string *value) {
+    std::lock_guard<std::mutex> lk(mu);
+    auto it = table.find(key);
+    if (it == table.end())
+        return false;
+    *value = it->second;
+    return true;
+}
+
+extern "C" {
+
+MYSQL *mysql_init(MYSQL *) {
+    return reinterpret_cast<MYSQL *>(new FakeConn);
+}
+
+int mysql_options(MYSQL *, enum mysql_option, const void *) {
+    return 0;
+}
+
+MYSQL *mysql_real_connect(MYSQL *m, const char *, const char *, const char *,
+                          const char *, unsigned int, const char *, unsigned long) {
+    return m;
+}
+
+int mysql_set_character_set(MYSQL *, const char *) {
+    return 0;
+}
+
+void mysql_close(MYSQL *m) {
+    delete conn_of(m);
+}
+
+const char *mysql_error(MYSQL *m) {
+    return conn_of(m)->err.c_str();
+}
+
+unsigned long mysql_real_escape_string(MYSQL *, char *to, const char *from,
+                                       unsigned long length) {
+    char *p = to;
+    for (unsigned long i = 0; i < length; i++) {
+        if (from[i] == '\'' || from[i] == '\\')
+            *p++ = '\\';
+        *p++ = from[i];
+    }
+    *p = '\0';
+    return p - to;
+}
+
+int mysql_real_query(MYSQL *m, const char *stmt, unsigned long length) {
+    FakeConn *c = conn_of(m);
+    std::string q(stmt, length);
+
+    std::unique_lock<std::mutex> lk(mu);
+    unstalled.wait(lk, [] { return !stalled; });
+
+    if (q == "START TRANSACTION") {
+        c->in_tx = true;
+        c->rows.clear();
+        return 0;
+    }
+    if (q == "COMMIT") {
+        for (const Row &r : c->rows)
+            apply(r);
+        c->rows.clear();
+        c->in_tx = false;
+        return 0;
+    }
+    if (q == "ROLLBACK") {
+        c->rows.clear();
+        c->in_tx = false;
+        return 0;
+    }
+
+    std::vector<Row> rows;
+    std::vector<std::string> lit = literals(q);
+    if (starts(q, "INSERT INTO kvstore")) {
+        for (size_t i = 0; i + 1 < lit.size(); i += 2)
+            rows.push_back({false, lit[i], lit[i + 1]});
+    } else if (starts(q, "DELETE FROM kvstore")) {
+        for (const std::string &k : lit)
+            rows.push_back({true, k, std::string()});
+    } else {
+        c->err = "unsupported statement: " + q.substr(0, 40);
+        return 1;
+    }
+
+    for (const Row &r : rows) {
+        if (c->in_tx)
+            c->rows.push_back(r);
+        else
+            apply(r);
+    }
+    return 0;
+}
+
+int mysql_query(MYSQL *m, const char *stmt) {
+    return mysql_real_query(m, stmt, std::strlen(stmt));
+}
+
+} // extern "C"
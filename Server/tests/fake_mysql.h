@@ -0,0 +1,17 @@
+#ifndef KV_FAKE_MYSQL_H
+#define KV_FAKE_MYSQL_H
+
+#include <string>
+
+// In-memory stand-in for the part of libmysqlclient that MySQLPool and
+// AsyncWriter use, so tests run without a server. It understands the
+// statements AsyncWriter sends (transactions, multi-row INSERT ... ON
+// DUPLICATE KEY UPDATE, DELETE by key); anything else fails.
+//  - a transaction's rows become visible at COMMIT.
+//  - while stalled, every query waits, as against a MySQL that hangs.
+
+void fake_mysql_stall(bool on);
+void fake_mysql_put(const std::string &key, const std::string &value);
+bool fake_mysql_get(const std::string &key, std::string *value);
+
+#endif // KV_FAKE_MYSQL_H
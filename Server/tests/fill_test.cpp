@@ -0,0 +1,153 @@
+// A write acknowledged but still queued for MySQL must keep miss fills
+// away from its key, even when the cache does not hold the new value.
+//
+//   make test
+//
+// The writer is stalled, so the POST's row waits in the queue. The cache
+// then drops the new value: admission rejects it when it leaves the
+// window. A GET now misses and reads the old row (or none) from MySQL;
+// it must not cache that. Once the writer has the row in, a miss fills
+// again. Handlers are followed step by step as server.cpp runs them.
+
+#include "cache.h"
+#include "async.h"
+#include "writegen.h"
+#include "fake_mysql.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        std::printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static WriteGenerations gens;
+
+static CacheOptions cache_options() {
+    CacheOptions o;
+    o.num_shards = 1;
+    o.per_shard_capacity = 64;
+    o.policy = EvictionPolicy::CLOCK;
+    o.admission = true;
+    return o;
+}
+
+// POST: stripe first, then the queue, then the caches.
+static bool post(AsyncWriter &w, ShardedLRUCache &cache, ShardedLRUCache &absent,
+                 const std::string &key, const std::string &value) {
+    CacheKey ck(key);
+    gens.begin(ck.hash, 2);
+    bool queued = w.async_insert(key, ck.hash, value);
+    if (queued) {
+        cache.cache_put(ck, value);
+        absent.cache_delete(ck);
+    }
+    gens.end(ck.hash, queued ? 1 : 2);
+    return queued;
+}
+
+// GET: the caches, then on a miss the row, filled in if the stripe
+// allows it. True if the key was found, its value in *value.
+static bool get(ShardedLRUCache &cache, ShardedLRUCache &absent,
+                const std::string &key, std::string *value) {
+    CacheKey ck(key);
+    uint64_t gen = gens.stripe(ck.hash).load(std::memory_order_acquire);
+    if (cache.cache_get(ck, *value))
+        return true;
+    if (absent.cache_get(ck, *value))
+        return false;
+
+    bool found = fake_mysql_get(key, value);
+    if (WriteGenerations::fillable(gen)) {
+        if (found)
+            cache.cache_fill(ck, *value, gens.stripe(ck.hash), gen);
+        else
+            absent.cache_fill(ck, std::string_view(), gens.stripe(ck.hash), gen);
+    }
+    return found;
+}
+
+// Make the cache drop key: hot keys own the main region, and one-off
+// keys push key out of the window, where it loses to them.
+static bool evict(ShardedLRUCache &cache, const std::string &key, int *seq) {
+    std::string v;
+    for (int round = 0; round < 64; round++) {
+        for (int i = 0; i < 64; i++) {
+            std::string hot = "hot" + std::to_string(i);
+            for (int n = 0; n < 4; n++)
+                if (!cache.cache_get(hot, v))
+                    cache.cache_put(hot, "h");
+        }
+        for (int i = 0; i < 16; i++)
+            cache.cache_put("scan" + std::to_string((*seq)++), "s");
+        CacheKey ck(key);
+        if (!cache.cache_get(ck, v))
+            return true;
+    }
+    return false;
+}
+
+static bool wait_idle(AsyncWriter &w) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (w.stats().queued > 0) {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+int main() {
+    MySQLPool pool("localhost", "test", "test", "test", 3306, 2);
+    AsyncOptions ao;
+    ao.batch_window = std::chrono::milliseconds(1);
+    ao.on_commit = [](uint64_t hash) { gens.end(hash); };
+    AsyncWriter writer(&pool, ao);
+    writer.start();
+
+    ShardedLRUCache cache(cache_options());
+    CacheOptions absent_opts;
+    absent_opts.num_shards = 1;
+    ShardedLRUCache absent(absent_opts);
+
+    fake_mysql_put("old", "v1");
+    int seq = 0;
+
+    // "old" has a row the POST replaces, "new" has none yet
+    for (const char *key : {"old", "new"}) {
+        std::string v;
+        fake_mysql_stall(true);
+
+        CHECK(post(writer, cache, absent, key, "v2"));
+        CHECK(evict(cache, key, &seq));
+        uint64_t rejected = cache.cache_stats().rejected;
+        CHECK(rejected > 0);
+
+        // the row is not in MySQL yet: whatever the GET reads there, it
+        // must not be cached
+        get(cache, absent, key, &v);
+        CHECK(!cache.cache_get(key, v));
+        CHECK(!absent.cache_get(key, v));
+
+        fake_mysql_stall(false);
+        CHECK(wait_idle(writer));
+        CHECK(WriteGenerations::fillable(
+            gens.stripe(CacheKey(key).hash).load()));
+
+        // once it is, a miss reads and caches the new value
+        CHECK(get(cache, absent, key, &v) && v == "v2");
+        CHECK(cache.cache_get(key, v) && v == "v2");
+    }
+
+    writer.stop();
+
+    std::printf(failures ? "fill_test: FAILED\n" : "fill_test: ok\n");
+    return failures ? 1 : 0;
+}